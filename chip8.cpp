@@ -1,9 +1,33 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <time.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "SDL.h"
+#include "chip8_env.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHIP8_X86 1
+#endif
 
 const uint32_t WAVE_FREQ = 440;
 const uint32_t AUDIO_SAMPLE_RATE = 44100;
+const uint16_t AUDIO_BUFFER_SAMPLES = 512;
+const uint32_t AUDIO_RING_SIZE = 8192;
 
 const unsigned int FPS = 60;
 const unsigned int CLOCK_RATE = 700;
@@ -12,882 +36,6697 @@ const unsigned int WINDOW_WIDTH = 64;
 const unsigned int WINDOW_HEIGHT = 32;
 const unsigned int SCALE_FACTOR = 20;
 
-const unsigned int MEMORY_SIZE = 4096;
+// the XO-CHIP address space, the most any machine has. plain CHIP-8 and SCHIP machines get 4 KB
+const unsigned int MEMORY_SIZE = 0x10000;
 const unsigned int REGISTER_COUNT = 16;
 const unsigned int STACK_SIZE = 16;
+// lores, the original resolution, and the SCHIP/XO-CHIP hires mode
 const unsigned int DISPLAY_WIDTH = 64;
 const unsigned int DISPLAY_HEIGHT = 32;
+const unsigned int HIRES_WIDTH = 128;
+const unsigned int HIRES_HEIGHT = 64;
+// XO-CHIP bit planes
+const unsigned int PLANE_COUNT = 2;
 const unsigned int KEY_COUNT = 16;
+// SCHIP RPL user flags, XO-CHIP has 16 of them
+const unsigned int FLAG_COUNT = 16;
+const unsigned int AUDIO_PATTERN_SIZE = 16;
 
 const uint32_t START_ADDRESS = 0x200;
+// the 8x10 digits of FX30 follow the 4x5 font
+const uint16_t BIG_FONT_ADDRESS = 0x50;
 
-const char RUNNING = 'R';
-const char QUIT = 'Q';
-const char PAUSED = 'P';
+// one bit plane at 128x64, word 0 of a row holding its left 64 pixels with the leftmost in the top bit.
+// lores uses the top 32 rows and word 0 of each
+typedef uint64_t Bitplane[HIRES_HEIGHT][2];
 
-int16_t VOLUME = 3000;
+static_assert(HIRES_WIDTH == 2 * 64, "framebuffer rows are packed into two words each");
+static_assert(HIRES_HEIGHT <= 64, "row masks are 64 bits wide");
 
-float lerp_rate = 0.5;
+const uint64_t ALL_ROWS = ~0ull;
 
-class Chip8
+const uint32_t SAMPLES_PER_FRAME = AUDIO_SAMPLE_RATE / FPS;
+const unsigned int MAX_BEEPER_EDGES = 32;
+
+static_assert((AUDIO_RING_SIZE & (AUDIO_RING_SIZE - 1)) == 0, "the audio ring indexes by masking");
+
+const char *const WINDOW_TITLE = "CHIP8 Emulator";
+
+const char RUNNING = 'R';
+const char QUIT = 'Q';
+const char PAUSED = 'P';
+const char REWINDING = 'B';
+
+// where a profile goes when profiling was switched on with P and no --stats or --folded file was given
+const char *const DEFAULT_STATS_FILE = "chip8-stats.json";
+const char *const DEFAULT_FOLDED_FILE = "chip8-stacks.folded";
+
+// build with -DCHIP8_TRACE=1 (make TRACE=1) to record every executed instruction
+#ifndef CHIP8_TRACE
+#define CHIP8_TRACE 0
+#endif
+
+const bool TRACE_ENABLED = CHIP8_TRACE;
+
+// the block core compiles its blocks to x86-64 where it can map executable memory. traced builds record
+// every instruction, so they keep the threaded handlers
+#if defined(__x86_64__) && defined(__unix__) && !CHIP8_TRACE
+#include <sys/mman.h>
+#define CHIP8_JIT 1
+#endif
+
+// build with -DCHIP8_LIBRARY=1 (make lib) for libchip8.so: the core behind chip8_env.h, without main()
+#ifndef CHIP8_LIBRARY
+#define CHIP8_LIBRARY 0
+#endif
+const unsigned int TRACE_BUFFER_SIZE = 4096;
+
+// machine state right before an instruction executes, written to the trace file as-is
+struct TraceRecord
 {
-private:
-    uint8_t memory[MEMORY_SIZE]{};
-    uint8_t registers[REGISTER_COUNT]{};
-    uint16_t stack[STACK_SIZE]{};
-    bool display[DISPLAY_WIDTH * DISPLAY_HEIGHT]{};
-    uint32_t pixel_color[DISPLAY_WIDTH * DISPLAY_HEIGHT]{};
-    bool keypad[KEY_COUNT]{};
-    uint16_t *stack_ptr;
-    uint16_t index{};
-    uint16_t pc{};
-    uint8_t delay_timer{};
-    uint8_t sound_timer{};
+    uint16_t pc;
     uint16_t opcode;
+    uint16_t index;
+    uint8_t registers[REGISTER_COUNT];
+};
 
+// tracing disabled: every call compiles away
+template <bool Enabled>
+class Tracer
+{
 public:
-    char state;
-
-    Chip8(char *rom_file_name);
-    void emulate_instruction();
-    void handle_input();
-    void update_timers(SDL_AudioDeviceID &dev);
-    void update_screen(SDL_Renderer **renderer);
+    bool open(const char *) { return false; }
+    void record(uint16_t, uint16_t, uint16_t, const uint8_t *) {}
+    void unknown(uint16_t) {}
+    void flush() {}
 };
 
-void audio_callback(void *config, uint8_t *stream, int len)
+// tracing enabled: records go into a ring buffer which is written out in batches once it fills up.
+// without a trace file the ring just keeps the most recent TRACE_BUFFER_SIZE instructions.
+template <>
+class Tracer<true>
 {
-    static uint32_t running_sample_index = 0;
-    const int32_t wave_period = AUDIO_SAMPLE_RATE / WAVE_FREQ;
-    const int32_t half_wave_period = wave_period / 2;
+private:
+    TraceRecord records[TRACE_BUFFER_SIZE];
+    unsigned int head = 0;
+    FILE *file = nullptr;
 
-    int16_t *buffer = (int16_t *)stream;
+public:
+    ~Tracer()
+    {
+        flush();
+        if (file)
+            fclose(file);
+    }
 
-    for (int i = 0; i < len / 2; ++i)
+    bool open(const char *file_name)
     {
-        if ((running_sample_index / half_wave_period) % 2)
-        {
-            buffer[i] = VOLUME;
-        }
-        else
+        file = fopen(file_name, "wb");
+        return file != nullptr;
+    }
+
+    void record(uint16_t pc, uint16_t opcode, uint16_t index, const uint8_t *registers)
+    {
+        TraceRecord &record = records[head];
+        record.pc = pc, record.opcode = opcode, record.index = index;
+        memcpy(record.registers, registers, sizeof record.registers);
+
+        if (++head == TRACE_BUFFER_SIZE)
         {
-            buffer[i] = -VOLUME;
+            flush();
+            head = 0;
         }
-        running_sample_index++;
     }
-}
 
-bool initialize_SDL(SDL_Window **window, SDL_Renderer **renderer, SDL_AudioSpec &want, SDL_AudioSpec &have, SDL_AudioDeviceID &dev)
-{
-    const char *window_title = "CHIP8 Emulator";
+    // opcodes no core implements run as no-ops; only trace builds say so
+    void unknown(uint16_t opcode)
+    {
+        fprintf(stderr, "UNIMPLEMENTED INSTRUCTION %04X\n", opcode);
+    }
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) != 0)
+    void flush()
     {
-        SDL_Log("Failed To Initialize SDL: %s\n", SDL_GetError());
-        return false;
+        if (file && head)
+            fwrite(records, sizeof(TraceRecord), head, file);
+        if (file)
+            head = 0;
     }
+};
 
-    *window = SDL_CreateWindow(window_title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH * SCALE_FACTOR, WINDOW_HEIGHT * SCALE_FACTOR, 0);
+const char *const OPCODE_GROUPS[16] = {"0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+                                       "8XYN", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EXNN", "FXNN"};
 
-    if (!(*window))
+// performance counter ticks spent on one part of the frame loop
+struct FrameTime
+{
+    uint64_t frames = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    void add(uint64_t ticks)
     {
-        SDL_Log("Failed To Create SDL Window %s\n", SDL_GetError());
-        return false;
+        frames++;
+        total += ticks;
+        max = ticks > max ? ticks : max;
     }
+};
 
-    *renderer = SDL_CreateRenderer((*window), -1, SDL_RENDERER_ACCELERATED);
+// a subroutine in the call tree, reached through the 2NNN calls on the path from the root
+struct CallNode
+{
+    uint32_t parent;
+    uint16_t address;
+    uint8_t depth;
+    uint64_t instructions; // executed in this subroutine itself, not in the ones it called
+};
 
-    if (!(*renderer))
+// counts what the cpu does while profiling is on: executions per opcode group and per pc, DXYN collisions,
+// time per frame and the 2NNN/00EE call tree. switched on and off at runtime; while it is off the cores run
+// as usual and only check the flag once per run()
+class Profiler
+{
+private:
+    std::vector<CallNode> nodes;
+    // parent << 16 | address -> child node
+    std::unordered_map<uint64_t, uint32_t> children;
+    uint32_t current = 0;
+    // calls made at full depth that haven't returned yet
+    uint32_t overflow = 0;
+
+public:
+    bool enabled = false;
+    uint64_t executions[16]{};
+    // allocated on first start, so machines that are never profiled don't pay for it
+    std::vector<uint64_t> pc_executions;
+    uint64_t draws = 0;
+    uint64_t collisions = 0;
+    FrameTime emulation;
+    FrameTime timers;
+    FrameTime render;
+
+    void start();
+    void stop() { enabled = false; }
+    bool used() const { return !nodes.empty(); }
+
+    void instruction(uint16_t pc, uint16_t opcode)
     {
-        SDL_Log("Failed To Create SDL Renderer %s\n", SDL_GetError());
-        return false;
+        executions[opcode >> 12]++;
+        pc_executions[pc]++;
+        nodes[current].instructions++;
+    }
+
+    void draw(bool collision)
+    {
+        draws++;
+        collisions += collision;
     }
 
-    want.freq = 44100, want.format = AUDIO_S16LSB, want.channels = 1, want.samples = 512, want.callback = audio_callback, want.userdata = nullptr;
+    void call(uint16_t address);
+    void ret();
 
-    dev = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
+    bool write_report(const char *file_name, const char *rom_file_name) const;
+    bool write_folded(const char *file_name) const;
+};
 
-    if (!dev)
+// a register condition for the debugger, like V3 == 05 or I > 300; register 16 is I
+struct Condition
+{
+    uint8_t reg;
+    char op; // one of = ! < >
+    uint16_t value;
+};
+
+// pc breakpoints and memory watchpoints as one bit per address, register conditions and single-stepping.
+// armed only while one of them is set or a step is in progress; until then run() checks the flag once and
+// the cores never look at any of it
+struct Debugger
+{
+    bool armed = false;
+    std::vector<uint64_t> breakpoints;
+    std::vector<uint64_t> watchpoints;
+    std::vector<Condition> conditions;
+    // whether the conditions held after the last instruction, so each one stops only when it becomes true
+    bool conditions_met = false;
+    // instructions left to single-step
+    uint64_t steps = 0;
+    // stepping over a call: stop when it returns to this address at this stack depth
+    bool stepping_over = false;
+    uint16_t return_address = 0;
+    uint8_t return_depth = 0;
+    // set when resuming, so the instruction the machine stopped at doesn't hit its own breakpoint again
+    bool skip_breakpoint = false;
+
+    static bool test(const std::vector<uint64_t> &bits, uint16_t address)
     {
-        SDL_Log("Failed to initialize audio devices %s\n", SDL_GetError());
-        return false;
+        return !bits.empty() && (bits[address / 64] >> (address % 64)) & 1;
     }
 
-    if (want.format != have.format || want.channels != have.channels)
+    static void set(std::vector<uint64_t> &bits, uint16_t address, bool on)
     {
-        SDL_Log("Failed to load desired audio spec\n");
-        return false;
+        if (bits.empty())
+            bits.assign(MEMORY_SIZE / 64, 0);
+        if (on)
+            bits[address / 64] |= 1ull << (address % 64);
+        else
+            bits[address / 64] &= ~(1ull << (address % 64));
     }
 
-    return true;
-}
+    static bool any(const std::vector<uint64_t> &bits)
+    {
+        return std::any_of(bits.begin(), bits.end(), [](uint64_t word) { return word != 0; });
+    }
 
-void set_screen(SDL_Renderer **renderer)
+    void update() { armed = any(breakpoints) || any(watchpoints) || !conditions.empty() || steps || stepping_over; }
+};
+
+// a rom as read from disk, shared read-only by every instance started from it
+struct RomImage
 {
+    std::vector<uint8_t> bytes;
+    uint32_t hash;
+};
 
-    SDL_SetRenderDrawColor(*renderer, 0, 0, 0, 255);
-    SDL_RenderClear(*renderer);
-}
+// every rom file the process has loaded, each read from disk once and kept for the life of the process.
+// images are stored by content hash, so files with the same contents share one; the file name index only
+// saves opening a file again. safe to use from the batch and golden worker threads
+class RomLibrary
+{
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const RomImage>> files;
+    std::unordered_map<uint32_t, std::vector<std::shared_ptr<const RomImage>>> images;
+
+public:
+    std::shared_ptr<const RomImage> load(const char *file_name);
+};
+
+class Chip8;
 
-void cleanup(SDL_Window **window, SDL_Renderer **renderer, SDL_AudioDeviceID &dev)
+// what a decoded instruction does, picked once by the decoder for the active profile. opcodes a profile
+// doesn't have decode to OP_NONE, opcodes no machine has to OP_UNKNOWN. a zeroed Instruction is
+// OP_DECODE, an address the cached core decodes the first time it runs it
+enum Operation
 {
-    SDL_DestroyRenderer(*renderer);
-    SDL_DestroyWindow(*window);
-    SDL_CloseAudioDevice(dev);
-    SDL_Quit();
-}
+    OP_DECODE,
+    OP_NONE,
+    OP_UNKNOWN,
+    OP_CLEAR,
+    OP_RETURN,
+    OP_SCROLL_DOWN,
+    OP_SCROLL_UP,
+    OP_SCROLL_RIGHT,
+    OP_SCROLL_LEFT,
+    OP_EXIT,
+    OP_RESOLUTION,
+    OP_JUMP,
+    OP_CALL,
+    OP_SKIP_EQUAL,
+    OP_SKIP_NOT_EQUAL,
+    OP_STORE_RANGE,
+    OP_LOAD_RANGE,
+    OP_SKIP_EQUAL_VY,
+    OP_LOAD,
+    OP_ADD,
+    OP_MOVE,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD_VY,
+    OP_SUB,
+    OP_SHIFT_RIGHT,
+    OP_SUBN,
+    OP_SHIFT_LEFT,
+    OP_SKIP_NOT_EQUAL_VY,
+    OP_LOAD_INDEX,
+    OP_JUMP_OFFSET,
+    OP_RANDOM,
+    OP_DRAW,
+    OP_SKIP_KEY,
+    OP_SKIP_NOT_KEY,
+    OP_LOAD_LONG_INDEX,
+    OP_PLANES,
+    OP_AUDIO_PATTERN,
+    OP_WAIT_KEY,
+    OP_ADD_INDEX,
+    OP_GET_DELAY,
+    OP_SET_DELAY,
+    OP_SET_SOUND,
+    OP_FONT,
+    OP_BIG_FONT,
+    OP_PITCH,
+    OP_SAVE_FLAGS,
+    OP_LOAD_FLAGS,
+    OP_BCD,
+    OP_STORE_REGISTERS,
+    OP_LOAD_REGISTERS,
+    OP_COUNT,
+};
 
-Chip8::Chip8(char *rom_file_name)
+// an instruction decoded once ahead of time: its operation plus pre-extracted operands
+struct Instruction
 {
-    // load font
-    const unsigned int FONTSET_SIZE = 80;
+    uint16_t opcode;
+    uint16_t NNN;
+    uint8_t operation;
+    uint8_t NN;
+    uint8_t N;
+    uint8_t X;
+    uint8_t Y;
+};
 
-    const uint8_t font[] =
-        {
-            0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-            0x20, 0x60, 0x20, 0x20, 0x70, // 1
-            0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-            0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-            0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-            0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-            0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-            0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-            0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-            0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-            0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-            0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-            0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-            0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-            0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-            0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+typedef void (*Handler)(Chip8 &chip8, const Instruction &in);
 
-        };
+// a straight-line run of translated instructions; the last one may branch, skip or write memory
+struct Block
+{
+    uint32_t offset;  // first instruction in the translated code pool
+    uint16_t length;  // instructions in the block, 0 if nothing has been translated at this address
+    bool translated;  // some block was translated from the byte at this address
+    uint8_t runs;     // times run through the threaded handlers, counting up to COMPILE_AFTER_RUNS
+};
 
-    memcpy(&memory[0], font, sizeof(font));
+const unsigned int MAX_BLOCK_LENGTH = 64;
+// translated instructions kept before the block core throws every block away and starts over
+const uint32_t CODE_POOL_INSTRUCTIONS = 1 << 16;
+
+#ifdef CHIP8_JIT
+// executable memory for the native blocks, and the most one block of MAX_BLOCK_LENGTH instructions can
+// take with its instruction records
+const size_t NATIVE_POOL_SIZE = 256 << 10;
+// a block is compiled once it has run this often, so code that keeps rewriting itself stays threaded
+const uint8_t COMPILE_AFTER_RUNS = 4;
+const size_t MAX_NATIVE_BLOCK = 128 + MAX_BLOCK_LENGTH * 48;
+
+// the block core's native code, mapped on first use. it is never writable and executable at once:
+// translating a block makes it writable and then executable again. a system that refuses either
+// leaves the block core on its threaded handlers
+class NativePool
+{
+public:
+    NativePool() = default;
+    NativePool(const NativePool &) = delete;
+    NativePool &operator=(const NativePool &) = delete;
+    ~NativePool()
+    {
+        if (base)
+            munmap(base, NATIVE_POOL_SIZE);
+    }
 
-    // open rom file
-    FILE *rom = fopen(rom_file_name, "rb");
-    if (!rom)
+    bool writable(bool on)
     {
-        SDL_Log("Rom File Could Not Opened\n");
-        return;
+        if (failed)
+            return false;
+        if (!base)
+        {
+            void *memory = mmap(nullptr, NATIVE_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            base = memory == MAP_FAILED ? nullptr : (uint8_t *)memory;
+        }
+        failed = !base || mprotect(base, NATIVE_POOL_SIZE, on ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0;
+        return !failed;
     }
 
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof memory - START_ADDRESS;
-    rewind(rom);
+    // the entry and exit stubs at the start stay, blocks after them go
+    void reset() { used = stubs; }
+
+    uint8_t *base = nullptr;
+    size_t used = 0;
+    size_t stubs = 0;
+    bool failed = false;
+};
 
-    if (rom_size > max_size)
+// enters native code at block with the machine and the instruction budget, returns the budget left
+typedef uint32_t (*NativeEntry)(Chip8 *chip8, uint32_t budget, const uint8_t *block);
+
+// x86-64 machine code for the block core. generated code keeps the machine in rbx and the budget in
+// r12d, and reaches machine fields as [rbx + disp32]
+struct Emitter
+{
+    uint8_t *at;
+
+    void bytes(std::initializer_list<uint8_t> list)
     {
-        SDL_Log("Rom File Size Too Large\n");
-        return;
+        for (uint8_t byte : list)
+            *at++ = byte;
     }
 
-    // load rom contents into memory
-    if (fread(&memory[START_ADDRESS], rom_size, 1, rom) != 1)
+    template <typename T>
+    void value(T v)
     {
-        SDL_Log("Could Not Load Rom Content Into Memory\n");
-        return;
+        memcpy(at, &v, sizeof v);
+        at += sizeof v;
     }
 
-    fclose(rom);
+    // ModRM for [rbx + disp32] with reg (a register or an opcode extension) in the middle field
+    void field(uint8_t reg, int32_t disp)
+    {
+        bytes({(uint8_t)(0x83 | reg << 3)});
+        value(disp);
+    }
 
-    stack_ptr = &stack[0];
-    // set pc to start address
-    pc = START_ADDRESS;
-    // everything successful, set state to running
-    state = 'R';
-    // set all pixels to black initially
-    memset(&pixel_color[0], 0, sizeof pixel_color);
-}
+    // rel32 to target, from the end of the four byte field
+    void rel32(const uint8_t *target) { value((int32_t)(target - (at + 4))); }
+};
+#endif
 
-void Chip8::handle_input()
+// interpreter cores selectable with --core; they must produce bit-identical results
+enum Core
 {
-    SDL_Event e;
-    while (SDL_PollEvent(&e))
-    {
-        if (e.type == SDL_QUIT)
-            state = 'Q';
-        else if (e.type == SDL_KEYDOWN)
-        {
-            switch (e.key.keysym.sym)
-            {
+    CORE_INTERPRETER, // fetch, decode and switch on every instruction
+    CORE_CACHED,      // dispatch through the pre-decoded instruction cache
+    CORE_BLOCK,       // run translated basic blocks as threaded code
+    CORE_COUNT
+};
 
-            case SDLK_ESCAPE:
-                state = 'Q';
-                break;
+// where FX55 and FX65 leave I
+enum IndexQuirk
+{
+    INDEX_ADVANCES,      // I += X + 1
+    INDEX_ADVANCES_TO_X, // I += X
+    INDEX_UNCHANGED,
+};
 
-            case SDLK_SPACE:
-                if (state == RUNNING)
-                    state = PAUSED;
-                else
-                    state = RUNNING;
-                break;
+// quirk profiles. each one is a set of compile-time switches, and every core is instantiated once per
+// profile, so a quirk costs nothing in the instruction handlers
+struct QuirksVIP
+{
+    static const bool shift_vx = false;       // 8XY6 and 8XYE shift VX in place instead of VY into VX
+    static const bool logic_resets_vf = true; // 8XY1, 8XY2 and 8XY3 clear VF
+    static const IndexQuirk index = INDEX_ADVANCES;
+    static const bool jump_vx = false;        // BXNN jumps to VX + XNN instead of V0 + NNN
+    static const bool wrap_sprites = false;   // DXYN wraps at the screen edges instead of clipping
+    static const bool index_overflow = false; // FX1E sets VF when I passes 0xFFF (the Amiga interpreter)
+    // instruction sets beyond CHIP-8. without them their opcodes do nothing, as on the original machines
+    static const bool schip = false;  // 00CN, 00FB-00FF, DXY0 16x16 sprites, FX30, FX75 and FX85
+    static const bool xochip = false; // 00DN, 5XY2, 5XY3, F000 NNNN, FN01, F002 and FX3A
+    static const uint32_t memory_size = 0x1000;
+};
 
-            case SDLK_i:
-                if (VOLUME)
-                    VOLUME -= 500;
-                break;
+struct QuirksCHIP48 : QuirksVIP
+{
+    static const bool shift_vx = true;
+    static const bool logic_resets_vf = false;
+    static const IndexQuirk index = INDEX_ADVANCES_TO_X;
+    static const bool jump_vx = true;
+};
 
-            case SDLK_o:
-                if (VOLUME < INT16_MAX)
-                    VOLUME += 500;
-                break;
+struct QuirksSCHIP : QuirksCHIP48
+{
+    static const IndexQuirk index = INDEX_UNCHANGED;
+    static const bool schip = true;
+};
 
-            case SDLK_n:
-                if (lerp_rate < 1.0)
-                    lerp_rate += 0.1;
-                break;
+// what current interpreters such as Octo do
+struct QuirksModern : QuirksVIP
+{
+    static const bool logic_resets_vf = false;
+    static const bool wrap_sprites = true;
+    static const bool schip = true;
+    static const bool xochip = true;
+    static const uint32_t memory_size = MEMORY_SIZE;
+};
 
-            case SDLK_m:
-                if (lerp_rate > 0.1)
-                    lerp_rate -= 0.1;
-                break;
+struct QuirksAmiga : QuirksCHIP48
+{
+    static const bool index_overflow = true;
+};
 
-            case SDLK_1:
-                keypad[0x1] = true;
-                break;
+enum Profile
+{
+    PROFILE_VIP,
+    PROFILE_CHIP48,
+    PROFILE_SCHIP,
+    PROFILE_MODERN,
+    PROFILE_AMIGA,
+    PROFILE_COUNT,
+};
 
-            case SDLK_2:
-                keypad[0x2] = true;
-                break;
+const char *const PROFILE_NAMES[PROFILE_COUNT] = {"vip", "chip48", "schip", "modern", "amiga"};
+const uint32_t PROFILE_MEMORY[PROFILE_COUNT] = {QuirksVIP::memory_size, QuirksCHIP48::memory_size, QuirksSCHIP::memory_size,
+                                                QuirksModern::memory_size, QuirksAmiga::memory_size};
 
-            case SDLK_3:
-                keypad[0x3] = true;
-                break;
+const char *const CORE_NAMES[CORE_COUNT] = {"interpreter", "cached", "block"};
 
-            case SDLK_4:
-                keypad[0xC] = true;
-                break;
+// --core and --quirks names; false for a name that isn't one
+bool core_from_name(const char *name, Core &core)
+{
+    for (uint32_t i = 0; i < CORE_COUNT; ++i)
+    {
+        if (strcmp(name, CORE_NAMES[i]) == 0)
+        {
+            core = (Core)i;
+            return true;
+        }
+    }
+    return false;
+}
 
-            case SDLK_q:
-                keypad[0x4] = true;
-                break;
+bool profile_from_name(const char *name, Profile &profile)
+{
+    for (uint32_t i = 0; i < PROFILE_COUNT; ++i)
+    {
+        if (strcmp(name, PROFILE_NAMES[i]) == 0)
+        {
+            profile = (Profile)i;
+            return true;
+        }
+    }
+    return false;
+}
 
-            case SDLK_w:
-                keypad[0x5] = true;
-                break;
+uint32_t fnv1a(const void *data, size_t size, uint32_t hash = 2166136261u)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= ((const uint8_t *)data)[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-            case SDLK_e:
-                keypad[0x6] = true;
-                break;
+// single-producer single-consumer sample queue between the emulation thread, which writes one frame of
+// samples at a time, and the audio callback, which drains it. the indices only ever grow and wrap on their own
+class AudioRing
+{
+private:
+    int16_t samples[AUDIO_RING_SIZE]{};
+    std::atomic<uint32_t> write_index{0};
+    std::atomic<uint32_t> read_index{0};
+    // most samples the producer lets queue up, which bounds latency
+    uint32_t limit = AUDIO_RING_SIZE;
+    // consumer side: the last sample played, where an underrun fades out from
+    int16_t last_sample = 0;
+
+    // producer side fill level statistics, taken after every write
+    uint32_t fill_min = AUDIO_RING_SIZE;
+    uint32_t fill_max = 0;
+    uint64_t fill_total = 0;
+    uint64_t fill_count = 0;
+
+    std::atomic<uint32_t> underruns{0};
+    std::atomic<uint64_t> missing_samples{0};
+    uint64_t dropped_samples = 0;
 
-            case SDLK_r:
-                keypad[0xD] = true;
-                break;
+public:
+    void set_limit(uint32_t samples) { limit = samples < AUDIO_RING_SIZE ? samples : AUDIO_RING_SIZE; }
+    uint32_t fill() const { return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_acquire); }
+    void write(const int16_t *data, uint32_t count);
+    void read(int16_t *out, uint32_t count);
+    void report(uint16_t buffer_samples) const;
+};
 
-            case SDLK_a:
-                keypad[0x7] = true;
-                break;
+// what the renderer needs from one emulated frame. lores frames are doubled up to 128x64 so the renderer
+// only ever deals with one size
+struct Frame
+{
+    Bitplane planes[PLANE_COUNT];
+    // hires rows drawn to since the last frame the renderer picked up
+    uint64_t dirty_rows;
+    bool hires;
+};
 
-            case SDLK_s:
-                keypad[0x8] = true;
-                break;
+// save state, version 5. the layout is fixed and padding-free so a snapshot is written and read as one
+// block in host byte order; the stack pointer is stored as a depth and the keypad as a bit mask (bit k =
+// key k). only the first memory_size bytes of memory belong to it, so a 4 KB machine's snapshot is about
+// 6 KB rather than 66. it is taken between frames, so the beeper edges of a frame in progress are not part of it
+const uint32_t SNAPSHOT_MAGIC = 0x38504843; // "CHP8"
+const uint16_t SNAPSHOT_VERSION = 5;
 
-            case SDLK_d:
-                keypad[0x9] = true;
-                break;
+struct Snapshot
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t index;
+    uint64_t cycles;
+    // both planes as the machine holds them, word 0 of a row the left half
+    Bitplane display[PLANE_COUNT];
+    uint16_t pc;
+    uint16_t keypad;
+    uint16_t stack[STACK_SIZE];
+    uint8_t stack_depth;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t waiting_key;
+    uint8_t any_key_pressed;
+    uint8_t hires;
+    uint8_t planes;
+    uint8_t pitch;
+    uint8_t pattern_audio;
+    uint8_t reserved[3];
+    uint32_t memory_size;
+    uint32_t random_state;
+    uint8_t registers[REGISTER_COUNT];
+    uint8_t flags[FLAG_COUNT];
+    uint8_t audio_pattern[AUDIO_PATTERN_SIZE];
+    uint8_t memory[MEMORY_SIZE];
+};
 
-            case SDLK_f:
-                keypad[0xE] = true;
-                break;
+static_assert(sizeof(Snapshot) == 16 + 16 * PLANE_COUNT * HIRES_HEIGHT + 4 + 2 * STACK_SIZE + 20 + REGISTER_COUNT + FLAG_COUNT +
+                                      AUDIO_PATTERN_SIZE + MEMORY_SIZE,
+              "Snapshot must not contain padding");
+static_assert(offsetof(Snapshot, memory) % sizeof(uint64_t) == 0, "the rewind buffer diffs snapshots a word at a time");
 
-            case SDLK_z:
-                keypad[0xA] = true;
-                break;
+// the bytes of a snapshot in use: everything up to memory, and the machine's memory
+size_t snapshot_size(const Snapshot &snapshot)
+{
+    return offsetof(Snapshot, memory) + snapshot.memory_size;
+}
 
-            case SDLK_x:
-                keypad[0x0] = true;
-                break;
+// one keypad change: mask is held from the instruction offset into frame on, until the next change
+struct InputEvent
+{
+    uint64_t frame;
+    uint32_t offset;
+    uint16_t mask;
+};
 
-            case SDLK_c:
-                keypad[0xB] = true;
-                break;
+// keypad history sorted by frame and offset
+typedef std::vector<InputEvent> InputLog;
 
-            case SDLK_v:
-                keypad[0xF] = true;
-                break;
+// input movie: the seed, clock, quirk profile and keypad history of a run, enough to replay it exactly from
+// power-on. stored as "C8MV", uint16 version, uint16 profile, uint32 seed, uint32 clock rate, uint32 event
+// count, then uint32 frame, uint32 offset and uint16 mask per event, all in host byte order. versions 1 and
+// 2 have a zero in place of the profile and no clock rate; version 1 has no offset either, every change at
+// a frame start
+const uint32_t MOVIE_MAGIC = 0x564D3843; // "C8MV"
+const uint16_t MOVIE_VERSION = 3;
 
-            default:
-                break;
-            }
-        }
-        else if (e.type == SDL_KEYUP)
-        {
-            switch (e.key.keysym.sym)
-            {
-            case SDLK_1:
-                keypad[0x1] = false;
-                break;
+struct Movie
+{
+    uint32_t seed = 0;
+    // 0 and PROFILE_COUNT for a movie that didn't record them
+    uint32_t clock_rate = 0;
+    Profile profile = PROFILE_COUNT;
+    InputLog inputs;
+};
 
-            case SDLK_2:
-                keypad[0x2] = false;
-                break;
+// the last frames of history inside a fixed byte budget. each frame is stored as the xor of its snapshot with
+// the next one, run-length coded over zero words, so an unchanged frame costs a few bytes. stepping back
+// xors the newest delta into the newest snapshot, which needs no keyframes; when the budget is full the
+// oldest deltas are overwritten and history simply gets shorter
+class RewindBuffer
+{
+private:
+    static const uint32_t MAX_WORDS = sizeof(Snapshot) / sizeof(uint64_t);
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+    std::vector<uint8_t> storage;
+    std::deque<Entry> entries;
+    uint32_t head = 0;
+    // the snapshot the newest delta leads to
+    Snapshot current;
+    bool has_current = false;
+    // worst case: a run header in front of every other word
+    uint8_t delta[MAX_WORDS * (sizeof(uint64_t) + 4) + 4];
+
+    uint32_t encode(const Snapshot &snapshot);
+    void apply(const uint8_t *data);
 
-            case SDLK_3:
-                keypad[0x3] = false;
-                break;
+public:
+    RewindBuffer(size_t budget) : storage(budget) {}
+    void push(const Snapshot &snapshot);
+    bool step_back(Snapshot &snapshot);
+    size_t frames() const { return entries.size(); }
+};
 
-            case SDLK_4:
-                keypad[0xC] = false;
-                break;
+// lock-free triple buffer: the emulation thread fills the back frame and publishes it, the render thread picks
+// up the newest published one, and neither ever waits for the other. frames the renderer never got to are
+// dropped, but their dirty rows are carried over into the next one
+class TripleBuffer
+{
+private:
+    static const uint8_t FRESH = 4;
 
-            case SDLK_q:
-                keypad[0x4] = false;
-                break;
+    Frame frames[3]{};
+    // index of the frame in the middle, plus FRESH while it hasn't been picked up
+    std::atomic<uint8_t> middle{1};
+    uint8_t back = 0;
+    uint8_t front = 2;
 
-            case SDLK_w:
-                keypad[0x5] = false;
-                break;
+public:
+    Frame &back_frame() { return frames[back]; }
+    const Frame &front_frame() const { return frames[front]; }
 
-            case SDLK_e:
-                keypad[0x6] = false;
-                break;
+    void publish()
+    {
+        const uint8_t previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+        const uint64_t missed_rows = previous & FRESH ? frames[previous & 3].dirty_rows : 0;
+        back = previous & 3;
+        frames[back].dirty_rows = missed_rows;
+    }
 
-            case SDLK_r:
-                keypad[0xD] = false;
-                break;
+    bool consume()
+    {
+        if (!(middle.load(std::memory_order_acquire) & FRESH))
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+};
 
-            case SDLK_a:
-                keypad[0x7] = false;
-                break;
+// records emulated frames and their audio to NAME.y4m (128x64 greyscale, 60 fps) and NAME.wav (16 bit mono).
+// the emulation side copies each frame into a fixed ring of slots and a writer thread converts and writes
+// them, so the disk never holds up a frame. when the ring is full the frame is dropped and counted; the
+// writer repeats the last picture and writes silence in its place, so the streams keep their timing
+class CaptureWriter
+{
+private:
+    static const uint32_t SLOTS = 2 * FPS;
 
-            case SDLK_s:
-                keypad[0x8] = false;
-                break;
+    struct Slot
+    {
+        Bitplane planes[PLANE_COUNT];
+        int16_t samples[SAMPLES_PER_FRAME];
+        // frames dropped right before this one
+        uint32_t dropped;
+    };
+
+    std::vector<Slot> slots;
+    std::atomic<uint32_t> write_index{0};
+    std::atomic<uint32_t> read_index{0};
+    std::atomic<bool> stopping{false};
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::thread writer;
+
+    FILE *video = nullptr;
+    FILE *audio = nullptr;
+    std::string video_name;
+    std::string audio_name;
+
+    // producer side
+    uint32_t pending_drops = 0;
+    uint64_t dropped = 0;
+    // writer side
+    uint64_t written = 0;
+    uint64_t audio_bytes = 0;
+    bool failed = false;
+    uint8_t picture[HIRES_WIDTH * HIRES_HEIGHT]{};
+
+    void run();
+    void write_frame(const Slot *slot);
+    void write_wav_header();
 
-            case SDLK_d:
-                keypad[0x9] = false;
-                break;
+public:
+    CaptureWriter() : slots(SLOTS) {}
+    ~CaptureWriter() { close(); }
+    bool open(const char *name);
+    // wait blocks while the ring is full instead of dropping, for headless runs that have no deadline
+    void push(const Frame &frame, const int16_t *samples, bool wait);
+    // drains the ring, finishes both files and reports; false if anything could not be written
+    bool close();
+};
 
-            case SDLK_f:
-                keypad[0xE] = false;
-                break;
+// spreads a cpu clock that isn't a multiple of FPS over frames, so 700 Hz runs 11 or 12 instructions
+// per frame and exactly 700 per second
+class FrameClock
+{
+private:
+    uint32_t clock_rate;
+    uint32_t remainder = 0;
 
-            case SDLK_z:
-                keypad[0xA] = false;
-                break;
+public:
+    FrameClock(uint32_t clock_rate) : clock_rate(clock_rate) {}
 
-            case SDLK_x:
-                keypad[0x0] = false;
-                break;
+    uint32_t next_frame()
+    {
+        remainder += clock_rate;
+        const uint32_t instructions = remainder / FPS;
+        remainder %= FPS;
+        return instructions;
+    }
+};
 
-            case SDLK_c:
-                keypad[0xB] = false;
-                break;
+// paces frames against the wall clock at FPS. each deadline is computed from the frame number instead of
+// being accumulated, so rounding never adds up to drift. after a stall of more than a few frames it starts
+// over from the current time rather than running a burst of frames to catch up
+class FrameScheduler
+{
+private:
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t frame = 0;
 
-            case SDLK_v:
-                keypad[0xF] = false;
-                break;
+public:
+    void wait_for_next_frame()
+    {
+        frame++;
+        const auto deadline = start + std::chrono::nanoseconds(frame * 1000000000ull / FPS);
+        const auto now = std::chrono::steady_clock::now();
+
+        if (now < deadline)
+            std::this_thread::sleep_until(deadline);
+        else if (now - deadline > std::chrono::milliseconds(100))
+        {
+            start = now;
+            frame = 0;
+        }
+    }
+};
+
+// process cpu time against wall time between samples, as a share of one core. clock() counts every thread
+// of the process, so this covers emulation, rendering and the audio callback together
+class CpuMeter
+{
+private:
+    clock_t first_cpu = clock();
+    clock_t last_cpu = first_cpu;
+    std::chrono::steady_clock::time_point first_wall = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_wall = first_wall;
+    uint64_t samples = 0;
+    double busiest = 0;
+
+    static double usage(clock_t cpu, std::chrono::duration<double> wall)
+    {
+        return wall.count() > 0 ? (double)cpu / CLOCKS_PER_SEC / wall.count() : 0.0;
+    }
+
+public:
+    // usage since the previous sample
+    double sample()
+    {
+        const clock_t cpu = clock();
+        const auto wall = std::chrono::steady_clock::now();
+        const double used = usage(cpu - last_cpu, wall - last_wall);
+        last_cpu = cpu;
+        last_wall = wall;
+        samples++;
+        if (used > busiest)
+            busiest = used;
+        return used;
+    }
+
+    // usage since the meter was made
+    double average() const { return usage(last_cpu - first_cpu, last_wall - first_wall); }
+
+    void report(const char *what) const
+    {
+        fprintf(stderr, "cpu: %.1f%% of a core on average, %.1f%% in the busiest of %llu %s\n", 100 * average(), 100 * busiest,
+                (unsigned long long)samples, what);
+    }
+};
+
+// the lock the window, the debug console and the emulation thread share. whoever handles input under it
+// calls wake, so a paused emulation thread can sleep until something happens instead of publishing the
+// same frame sixty times a second
+struct EmulationLock
+{
+    std::mutex mutex;
+    std::condition_variable woken;
+    // bumped by every wake, so input handled while the emulation thread was between frames isn't missed
+    uint64_t wakes = 0;
+
+    // keypad changes not run yet, stamped with the SDL_GetTicks time of their event
+    struct KeypadChange
+    {
+        uint32_t time;
+        uint16_t mask;
+    };
+    std::vector<KeypadChange> keypad;
+
+    void wake()
+    {
+        wakes++;
+        woken.notify_one();
+    }
+};
+
+// the window side of the emulator: phosphor fade state and the texture it is drawn through
+class Screen
+{
+private:
+    uint32_t pixel_color[HIRES_WIDTH * HIRES_HEIGHT]{};
+    Bitplane planes[PLANE_COUNT]{};
+    bool hires = false;
+    // rows whose pixel_color hasn't settled yet
+    uint64_t fading_rows = ALL_ROWS;
+    // the window needs a full repaint even if no pixel changed
+    bool needs_redraw = true;
+    float lerp_rate = 0.5;
+    bool pixel_grid = true;
+    // the grid lines at window resolution, transparent between them, baked for one size and resolution
+    SDL_Texture *grid = nullptr;
+    bool grid_stale = true;
+    bool grid_hires = false;
+
+    void bake_grid(SDL_Renderer *renderer);
+
+public:
+    void handle_input(const SDL_Event &e);
+    void update_screen(SDL_Renderer **renderer, SDL_Texture *texture, const Frame &frame);
+    // frees the grid texture, before the renderer goes
+    void release();
+    // still has something to show even if no new frame comes
+    bool busy() const { return fading_rows || needs_redraw; }
+};
+
+// which keypad key each keyboard scancode and game controller button presses, -1 for none. scancodes are
+// physical key positions, so the default 1234/QWER/ASDF/ZXCV block stays in place on any keyboard layout
+struct Keymap
+{
+    int8_t keys[SDL_NUM_SCANCODES];
+    int8_t buttons[SDL_CONTROLLER_BUTTON_MAX];
+
+    Keymap();
+};
+
+// the window's keypad input: keyboard and every connected game controller, through the keymap. each device
+// holds its own keys and the keypad sees all of them, so one player letting go doesn't release another's key
+class Controls
+{
+private:
+    struct Pad
+    {
+        SDL_GameController *controller;
+        SDL_JoystickID id;
+        uint16_t keys;
+    };
+
+    Keymap keymap;
+    uint16_t keyboard = 0;
+    std::vector<Pad> pads;
+
+public:
+    Controls(const Keymap &keymap) : keymap(keymap) {}
+    // true when the event changed the keys held
+    bool handle_input(const SDL_Event &e);
+    uint16_t keys() const;
+};
+
+class Chip8
+{
+private:
+    // as much as the profile's machine had, more only for a rom that doesn't fit; addresses wrap at the end
+    std::vector<uint8_t> memory;
+    uint16_t memory_mask = 0;
+    // where the rom image ends in memory
+    uint32_t rom_end = START_ADDRESS;
+    uint8_t registers[REGISTER_COUNT]{};
+    uint16_t stack[STACK_SIZE]{};
+    // rows at the current resolution, lores using the top 32 rows and the left 64 columns
+    Bitplane display[PLANE_COUNT]{};
+    // bit y set: row y of display changed since the last published frame
+    uint64_t dirty_rows = ALL_ROWS;
+    bool hires = false;
+    // planes FN01 selected for drawing, clearing and scrolling
+    uint8_t planes = 1;
+    uint8_t flags[FLAG_COUNT]{};
+    // XO-CHIP audio: F002 switches the beeper from the square wave to this 1-bit loop, played at the FX3A pitch
+    uint8_t audio_pattern[AUDIO_PATTERN_SIZE]{};
+    uint8_t pitch = 64;
+    bool pattern_audio = false;
+    double pattern_position = 0;
+    bool keypad[KEY_COUNT]{};
+    uint16_t *stack_ptr;
+    uint16_t index{};
+    uint16_t pc{};
+    uint8_t delay_timer{};
+    uint8_t sound_timer{};
+    uint16_t opcode;
+    // FX0A progress: a key has gone down and we are waiting for its release
+    bool any_key_pressed = false;
+    uint8_t waiting_key = 0xFF;
+    // xorshift32 state behind CXNN, per instance so runs with the same seed are identical
+    uint32_t random_state;
+    int16_t volume = 3000;
+    uint32_t running_sample_index = 0;
+    // instructions started since power-on
+    uint64_t cycles = 0;
+    // beeper state when the current frame began and where FX18 switched it during the frame
+    uint64_t frame_start_cycle = 0;
+    // bumped by every instruction that changes memory, the display, flags, planes or audio
+    uint32_t side_effects = 0;
+    // where the last backward 1NNN jumped from and the state it left behind, for spotting idle loops
+    struct
+    {
+        bool valid;
+        uint16_t pc;
+        uint64_t cycles;
+        uint32_t side_effects;
+        uint32_t random_state;
+        uint16_t index;
+        uint8_t depth;
+        uint8_t delay_timer;
+        uint8_t registers[REGISTER_COUNT];
+    } last_jump{};
+    // length in instructions of the idle loop just found, 0 if none
+    uint64_t idle_period = 0;
+    uint64_t idle_skipped = 0;
+    bool beeper_at_frame_start = false;
+    struct
+    {
+        uint64_t cycle;
+        bool on;
+    } beeper_edges[MAX_BEEPER_EDGES];
+    uint8_t beeper_edge_count = 0;
+    Tracer<TRACE_ENABLED> tracer;
+    Core core = CORE_INTERPRETER;
+    // one entry per address, allocated when the cached core is selected
+    std::vector<Instruction> decoded;
+    // block and code pool of the block core, allocated when it is selected
+    std::vector<Block> blocks;
+    std::vector<Instruction> code;
+#ifdef CHIP8_JIT
+    // native code of the blocks, and its entry per address (null where none), read by the code itself to
+    // chain from one block to the next
+    NativePool native;
+    std::vector<const uint8_t *> native_blocks;
+#endif
+
+    Profile profile = PROFILE_VIP;
+    // fnv-1a of the rom image, the key of the quirk profile database
+    uint32_t rom_hash = 0;
+
+    uint32_t width() const { return hires ? HIRES_WIDTH : DISPLAY_WIDTH; }
+    uint32_t height() const { return hires ? HIRES_HEIGHT : DISPLAY_HEIGHT; }
+    template <typename Quirks>
+    void skip() { pc += Quirks::xochip && next_opcode() == 0xF000 ? 4 : 2; }
+    void clear_screen();
+    void set_resolution(bool high);
+    void scroll_down(uint8_t N);
+    void scroll_up(uint8_t N);
+    void scroll_right();
+    void scroll_left();
+    void exit_interpreter();
+    template <typename Quirks>
+    void draw_sprite(uint8_t X, uint8_t Y, uint8_t N);
+    void store_range(uint8_t X, uint8_t Y);
+    void load_range(uint8_t X, uint8_t Y);
+    void load_long_index();
+    void load_audio_pattern();
+    void wait_for_key(uint8_t X);
+    void set_sound_timer(uint8_t value);
+    void store_bcd(uint8_t X);
+    template <typename Quirks>
+    void store_registers(uint8_t X);
+    template <typename Quirks>
+    void load_registers(uint8_t X);
+    template <typename Quirks>
+    void add_to_index(uint8_t X);
+    template <typename Quirks>
+    void execute_instruction();
+    template <typename Quirks>
+    void run_interpreter(uint32_t instructions);
+    void resize_memory();
+    void invalidate(uint16_t address, uint32_t length);
+    template <typename Quirks>
+    Instruction decode(uint16_t address) const;
+    Instruction decode(uint16_t address) const;
+    template <typename Quirks>
+    void execute_decoded(Instruction in);
+    template <typename Quirks, uint8_t OPERATION>
+    static void execute_operation(Chip8 &chip8, const Instruction &in);
+    template <typename Quirks, size_t... OPERATIONS>
+    static const Handler *handlers(std::index_sequence<OPERATIONS...>);
+    template <typename Quirks, uint8_t OPERATION>
+    static void step_operation(Chip8 &chip8, const Instruction &in);
+    template <typename Quirks, size_t... OPERATIONS>
+    static const Handler *step_handlers(std::index_sequence<OPERATIONS...>);
+    template <typename Quirks>
+    void run_cached(uint32_t instructions);
+    template <typename Quirks>
+    Block &translate(uint16_t address);
+    void drop_blocks(uint32_t address);
+#ifdef CHIP8_JIT
+    template <typename Quirks>
+    void compile_block(uint16_t address, const Block &block);
+    template <typename Quirks>
+    void compile_instruction(Emitter &out, const Instruction &in, uint16_t address, const uint8_t *record);
+    int32_t field(const void *member) const { return (int32_t)((const uint8_t *)member - (const uint8_t *)this); }
+#endif
+    void flush_blocks();
+    template <typename Quirks>
+    void run_blocks(uint32_t instructions);
+    template <typename Quirks>
+    void run_core(uint32_t instructions, bool instrumented);
+    uint8_t random_byte();
+    void power_on(const RomImage &rom, uint32_t seed);
+    void jump(uint16_t address);
+    uint32_t skip_idle(uint32_t remaining);
+    bool break_before();
+    bool break_after(uint16_t instruction, uint16_t first_written);
+    bool evaluate_conditions() const;
+    void debug_stop(const char *reason);
+    void print_registers() const;
+    void print_disassembly(uint16_t address, uint32_t count) const;
+
+public:
+    char state = QUIT;
+    Profiler profiler;
+    Debugger debugger;
+
+    Chip8(const char *rom_file_name, uint32_t seed);
+    Chip8(const RomImage &rom, uint32_t seed);
+    bool trace_to(const char *file_name) { return tracer.open(file_name); }
+    void set_core(Core new_core);
+    void set_profile(Profile new_profile);
+    uint32_t rom_identity() const { return rom_hash; }
+    Profile quirk_profile() const { return profile; }
+    void run(uint32_t instructions);
+    void emulate_instruction();
+    void handle_input(const SDL_Event &e);
+    void tick_timers();
+    // tick_timers, after rendering the frame's audio into samples
+    void update_timers(int16_t *samples);
+    void publish(Frame &frame);
+    void synthesize_audio(int16_t *buffer, uint32_t samples);
+    void set_keypad(uint16_t mask);
+    bool pixel(uint32_t x, uint32_t y, uint32_t plane = 0) const { return (display[plane][y][x / 64] >> (63 - x % 64)) & 1; }
+    uint32_t display_hash() const;
+    uint16_t keypad_mask() const;
+    uint16_t next_opcode() const { return (memory[pc & memory_mask] << 8) | memory[(pc + 1) & memory_mask]; }
+    void save_state(Snapshot &snapshot) const;
+    bool load_state(const Snapshot &snapshot);
+    bool debug_command(const char *line);
+    uint64_t idle_instructions() const { return idle_skipped; }
+    // what chip8_env.h hands out without copying
+    const Bitplane *framebuffer() const { return display; }
+    bool high_resolution() const { return hires; }
+    const uint8_t *ram() const { return memory.data(); }
+    uint32_t ram_size() const { return memory.size(); }
+    const uint8_t *v_registers() const { return registers; }
+};
+
+// renders the frame that is ending as a square wave (or the XO-CHIP pattern) gated by the beeper, spreading the frame's instructions
+// evenly over its samples so an FX18 mid-frame switches the tone on or off at the matching sample
+void Chip8::synthesize_audio(int16_t *buffer, uint32_t samples)
+{
+    const int32_t wave_period = AUDIO_SAMPLE_RATE / WAVE_FREQ;
+    const int32_t half_wave_period = wave_period / 2;
+    const uint64_t frame_cycles = cycles - frame_start_cycle;
+
+    bool on = beeper_at_frame_start;
+    uint8_t edge = 0;
+
+    // XO-CHIP plays the 128-bit pattern at 4000 * 2^((pitch - 64) / 48) bits per second
+    const double pattern_step = 4000.0 * pow(2.0, (pitch - 64) / 48.0) / AUDIO_SAMPLE_RATE;
+
+    for (uint32_t i = 0; i < samples; ++i)
+    {
+        const uint64_t cycle = frame_start_cycle + i * frame_cycles / samples;
+        while (edge < beeper_edge_count && beeper_edges[edge].cycle <= cycle)
+            on = beeper_edges[edge++].on;
+
+        if (!on)
+        {
+            buffer[i] = 0;
+            continue;
+        }
+
+        if (pattern_audio)
+        {
+            const uint32_t bit = (uint32_t)pattern_position & (AUDIO_PATTERN_SIZE * 8 - 1);
+            buffer[i] = audio_pattern[bit / 8] & (0x80 >> (bit % 8)) ? volume : -volume;
+            pattern_position += pattern_step;
+            if (pattern_position >= AUDIO_PATTERN_SIZE * 8)
+                pattern_position -= AUDIO_PATTERN_SIZE * 8;
+            continue;
+        }
+
+        if ((running_sample_index / half_wave_period) % 2)
+        {
+            buffer[i] = volume;
+        }
+        else
+        {
+            buffer[i] = -volume;
+        }
+        running_sample_index++;
+    }
+}
+
+void AudioRing::write(const int16_t *data, uint32_t count)
+{
+    const uint32_t head = write_index.load(std::memory_order_relaxed);
+    const uint32_t queued = head - read_index.load(std::memory_order_acquire);
+    const uint32_t space = queued < limit ? limit - queued : 0;
+    const uint32_t n = count < space ? count : space;
+
+    for (uint32_t i = 0; i < n; ++i)
+        samples[(head + i) & (AUDIO_RING_SIZE - 1)] = data[i];
+
+    write_index.store(head + n, std::memory_order_release);
+    dropped_samples += count - n;
+
+    const uint32_t level = queued + n;
+    fill_min = level < fill_min ? level : fill_min;
+    fill_max = level > fill_max ? level : fill_max;
+    fill_total += level;
+    fill_count++;
+}
+
+// runs on the audio thread. when the ring runs dry the rest of the buffer ramps from the last sample
+// down to silence instead of cutting off, which would click
+void AudioRing::read(int16_t *out, uint32_t count)
+{
+    const uint32_t tail = read_index.load(std::memory_order_relaxed);
+    const uint32_t available = write_index.load(std::memory_order_acquire) - tail;
+    const uint32_t n = count < available ? count : available;
+
+    for (uint32_t i = 0; i < n; ++i)
+        out[i] = samples[(tail + i) & (AUDIO_RING_SIZE - 1)];
+
+    read_index.store(tail + n, std::memory_order_release);
+
+    if (n)
+        last_sample = out[n - 1];
+
+    if (n < count)
+    {
+        const uint32_t missing = count - n;
+        for (uint32_t i = 0; i < missing; ++i)
+            out[n + i] = (int32_t)last_sample * (int32_t)(missing - 1 - i) / (int32_t)missing;
+
+        last_sample = 0;
+        underruns.fetch_add(1, std::memory_order_relaxed);
+        missing_samples.fetch_add(missing, std::memory_order_relaxed);
+    }
+}
+
+void AudioRing::report(uint16_t buffer_samples) const
+{
+    fprintf(stderr, "audio: %u sample device buffer, ring fill min %u avg %.0f max %u (limit %u), %u underruns (%llu samples), %llu samples dropped\n",
+            buffer_samples, fill_count ? fill_min : 0, fill_count ? (double)fill_total / fill_count : 0.0, fill_max, limit,
+            underruns.load(), (unsigned long long)missing_samples.load(), (unsigned long long)dropped_samples);
+}
+
+void audio_callback(void *config, uint8_t *stream, int len)
+{
+    // config is the ring the emulation thread fills
+    ((AudioRing *)config)->read((int16_t *)stream, len / 2);
+}
+
+bool initialize_SDL(SDL_Window **window, SDL_Renderer **renderer, SDL_Texture **texture, SDL_AudioSpec &want, SDL_AudioSpec &have, SDL_AudioDeviceID &dev, AudioRing &audio, uint16_t audio_buffer_samples)
+{
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER) != 0)
+    {
+        SDL_Log("Failed To Initialize SDL: %s\n", SDL_GetError());
+        return false;
+    }
+
+    *window = SDL_CreateWindow(WINDOW_TITLE, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH * SCALE_FACTOR, WINDOW_HEIGHT * SCALE_FACTOR, 0);
+
+    if (!(*window))
+    {
+        SDL_Log("Failed To Create SDL Window %s\n", SDL_GetError());
+        return false;
+    }
+
+    *renderer = SDL_CreateRenderer((*window), -1, SDL_RENDERER_ACCELERATED);
+
+    if (!(*renderer))
+    {
+        SDL_Log("Failed To Create SDL Renderer %s\n", SDL_GetError());
+        return false;
+    }
+
+    // one texel per hires pixel, stretched to the window by SDL_RenderCopy
+    *texture = SDL_CreateTexture(*renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, HIRES_WIDTH, HIRES_HEIGHT);
+
+    if (!(*texture))
+    {
+        SDL_Log("Failed To Create SDL Texture %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_SetTextureBlendMode(*texture, SDL_BLENDMODE_NONE);
+
+    want.freq = AUDIO_SAMPLE_RATE, want.format = AUDIO_S16LSB, want.channels = 1, want.samples = audio_buffer_samples, want.callback = audio_callback, want.userdata = &audio;
+
+    dev = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
+
+    if (!dev)
+    {
+        SDL_Log("Failed to initialize audio devices %s\n", SDL_GetError());
+        return false;
+    }
+
+    if (want.format != have.format || want.channels != have.channels)
+    {
+        SDL_Log("Failed to load desired audio spec\n");
+        return false;
+    }
+
+    // the device keeps running, silence comes from the ring. let a few device buffers queue up so a late
+    // frame doesn't underrun, but no more than that or the beeper lags behind the game
+    audio.set_limit(2 * SAMPLES_PER_FRAME + 2 * have.samples);
+    SDL_PauseAudioDevice(dev, 0);
+
+    return true;
+}
+
+void set_screen(SDL_Renderer **renderer)
+{
+
+    SDL_SetRenderDrawColor(*renderer, 0, 0, 0, 255);
+    SDL_RenderClear(*renderer);
+}
+
+void cleanup(SDL_Window **window, SDL_Renderer **renderer, SDL_Texture **texture, SDL_AudioDeviceID &dev)
+{
+    SDL_DestroyTexture(*texture);
+    SDL_DestroyRenderer(*renderer);
+    SDL_DestroyWindow(*window);
+    SDL_CloseAudioDevice(dev);
+    SDL_Quit();
+}
+
+// the 4x5 hex digits every instance starts with at address 0
+const uint8_t FONT[] =
+    {
+        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+        0x20, 0x60, 0x20, 0x20, 0x70, // 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+
+    };
+
+// SCHIP/XO-CHIP 8x10 digits for FX30
+const uint8_t BIG_FONT[] =
+    {
+        0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+        0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+        0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+        0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+    };
+
+// reads the whole file once. the FILE is closed on every path
+std::shared_ptr<const RomImage> RomLibrary::load(const char *file_name)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto file = files.find(file_name);
+        if (file != files.end())
+            return file->second;
+    }
+
+    // read without holding the lock, so workers loading different roms don't wait on each other
+    FILE *rom = fopen(file_name, "rb");
+    if (!rom)
+    {
+        SDL_Log("Rom File Could Not Opened\n");
+        return nullptr;
+    }
+
+    fseek(rom, 0, SEEK_END);
+    const long rom_size = ftell(rom);
+    rewind(rom);
+
+    if (rom_size < 0 || (size_t)rom_size > MEMORY_SIZE - START_ADDRESS)
+    {
+        SDL_Log("Rom File Size Too Large\n");
+        fclose(rom);
+        return nullptr;
+    }
+
+    std::shared_ptr<RomImage> image = std::make_shared<RomImage>();
+    image->bytes.resize(rom_size);
+    const bool read = fread(image->bytes.data(), rom_size, 1, rom) == 1;
+    fclose(rom);
+    if (!read)
+    {
+        SDL_Log("Could Not Load Rom Content Into Memory\n");
+        return nullptr;
+    }
+    image->hash = fnv1a(image->bytes.data(), image->bytes.size());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // another thread may have loaded the same file meanwhile, or a file with the same contents
+    std::vector<std::shared_ptr<const RomImage>> &same_hash = images[image->hash];
+    for (const std::shared_ptr<const RomImage> &existing : same_hash)
+    {
+        if (existing->bytes == image->bytes)
+            return files[file_name] = existing;
+    }
+    same_hash.push_back(image);
+    return files[file_name] = image;
+}
+
+RomLibrary rom_library;
+
+Chip8::Chip8(const char *rom_file_name, uint32_t seed)
+{
+    const std::shared_ptr<const RomImage> rom = rom_library.load(rom_file_name);
+    // a rom that couldn't be loaded leaves the machine in QUIT
+    if (rom)
+        power_on(*rom, seed);
+}
+
+Chip8::Chip8(const RomImage &rom, uint32_t seed)
+{
+    power_on(rom, seed);
+}
+
+// starting an instance is copying the fonts and the shared rom image into its memory, no file access
+void Chip8::power_on(const RomImage &rom, uint32_t seed)
+{
+    // xorshift32 never leaves state 0, so spread the seed first and keep it away from there
+    random_state = seed * 2654435761u + 0x6D2B79F5u;
+    if (!random_state)
+        random_state = 1;
+
+    rom_end = START_ADDRESS + rom.bytes.size();
+    memory.clear();
+    resize_memory();
+    memcpy(&memory[0], FONT, sizeof(FONT));
+    memcpy(&memory[BIG_FONT_ADDRESS], BIG_FONT, sizeof(BIG_FONT));
+    memcpy(&memory[START_ADDRESS], rom.bytes.data(), rom.bytes.size());
+
+    rom_hash = rom.hash;
+    stack_ptr = &stack[0];
+    // set pc to start address
+    pc = START_ADDRESS;
+    // everything successful, set state to running
+    state = 'R';
+}
+
+// the emulator's own keys; the keypad comes in through Controls and the emulation thread
+void Chip8::handle_input(const SDL_Event &e)
+{
+    if (e.type == SDL_QUIT)
+        state = 'Q';
+    else if (e.type == SDL_KEYDOWN)
+    {
+        switch (e.key.keysym.sym)
+        {
+
+        case SDLK_ESCAPE:
+            state = 'Q';
+            break;
+
+        case SDLK_SPACE:
+            if (state == RUNNING)
+                state = PAUSED;
+            else
+            {
+                state = RUNNING;
+                // unarmed, nothing would consume the flag and it would swallow the next breakpoint set
+                debugger.skip_breakpoint = debugger.armed;
+            }
+            break;
+
+        // hold to run backwards through the rewind buffer
+        case SDLK_BACKSPACE:
+            if (state == RUNNING)
+                state = REWINDING;
+            break;
+
+        case SDLK_p:
+            if (profiler.enabled)
+                profiler.stop();
+            else
+                profiler.start();
+            break;
+
+        case SDLK_i:
+            if (volume)
+                volume -= 500;
+            break;
+
+        case SDLK_o:
+            if (volume < INT16_MAX)
+                volume += 500;
+            break;
+
+        default:
+            break;
+        }
+    }
+    else if (e.type == SDL_KEYUP)
+    {
+        switch (e.key.keysym.sym)
+        {
+        case SDLK_BACKSPACE:
+            if (state == REWINDING)
+                state = RUNNING;
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+Keymap::Keymap()
+{
+    memset(keys, -1, sizeof keys);
+    memset(buttons, -1, sizeof buttons);
+
+    const SDL_Scancode block[KEY_COUNT] = {
+        SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+        SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+        SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+        SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V};
+    for (int8_t key = 0; key < (int8_t)KEY_COUNT; ++key)
+        keys[block[key]] = key;
+
+    // the d-pad on 5/7/8/9 and A and B on 6 and 4, the layout most roms move and act with
+    buttons[SDL_CONTROLLER_BUTTON_DPAD_UP] = 0x5;
+    buttons[SDL_CONTROLLER_BUTTON_DPAD_LEFT] = 0x7;
+    buttons[SDL_CONTROLLER_BUTTON_DPAD_DOWN] = 0x8;
+    buttons[SDL_CONTROLLER_BUTTON_DPAD_RIGHT] = 0x9;
+    buttons[SDL_CONTROLLER_BUTTON_A] = 0x6;
+    buttons[SDL_CONTROLLER_BUTTON_B] = 0x4;
+}
+
+bool Controls::handle_input(const SDL_Event &e)
+{
+    const uint16_t before = keys();
+
+    switch (e.type)
+    {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+    {
+        const int8_t key = e.key.repeat ? -1 : keymap.keys[e.key.keysym.scancode];
+        if (key >= 0)
+            keyboard = e.type == SDL_KEYDOWN ? keyboard | 1 << key : keyboard & ~(1 << key);
+        break;
+    }
+
+    // sent for every controller already plugged in at startup too
+    case SDL_CONTROLLERDEVICEADDED:
+        if (SDL_GameController *controller = SDL_GameControllerOpen(e.cdevice.which))
+            pads.push_back({controller, SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(controller)), 0});
+        break;
+
+    case SDL_CONTROLLERDEVICEREMOVED:
+        for (size_t i = 0; i < pads.size(); ++i)
+        {
+            if (pads[i].id == e.cdevice.which)
+            {
+                SDL_GameControllerClose(pads[i].controller);
+                pads.erase(pads.begin() + i);
+                break;
+            }
+        }
+        break;
+
+    case SDL_CONTROLLERBUTTONDOWN:
+    case SDL_CONTROLLERBUTTONUP:
+    {
+        const int8_t key = e.cbutton.button < SDL_CONTROLLER_BUTTON_MAX ? keymap.buttons[e.cbutton.button] : -1;
+        for (Pad &pad : pads)
+        {
+            if (pad.id == e.cbutton.which && key >= 0)
+                pad.keys = e.type == SDL_CONTROLLERBUTTONDOWN ? pad.keys | 1 << key : pad.keys & ~(1 << key);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    return keys() != before;
+}
+
+uint16_t Controls::keys() const
+{
+    uint16_t mask = keyboard;
+    for (const Pad &pad : pads)
+        mask |= pad.keys;
+    return mask;
+}
+
+// lerp-helper function
+uint32_t lerp(uint32_t initial, uint32_t final, float t)
+{
+    // extract and handle RGBa separately
+    uint8_t r_initial = (initial >> 24) & 0xFF;
+    uint8_t g_initial = (initial >> 16) & 0xFF;
+    uint8_t b_initial = (initial >> 8) & 0xFF;
+    uint8_t a_initial = (initial >> 0) & 0xFF;
+
+    uint8_t r_final = (final >> 24) & 0xFF;
+    uint8_t g_final = (final >> 16) & 0xFF;
+    uint8_t b_final = (final >> 8) & 0xFF;
+    uint8_t a_final = (final >> 0) & 0xFF;
+
+    // use the "precise" method to generate a middle color
+    uint8_t r = (1 - t) * r_initial + (t * r_final);
+    uint8_t g = (1 - t) * g_initial + (t * g_final);
+    uint8_t b = (1 - t) * b_initial + (t * b_final);
+    uint8_t a = (1 - t) * a_initial + (t * a_final);
+
+    uint32_t res = (r << 24) | (g << 16) | (b << 8) | (a << 0);
+    return res;
+}
+
+// the fade kernels move the pixels of pixel_color in the rows selected by row_mask towards the palette color
+// of their plane bits, in 8.8 fixed point: channel = (channel * (256 - t) + target * t) >> 8 where t is
+// lerp_rate * 256. that is lerp()'s "precise" formula with t rounded to 1/256, so results stay within 1 of it
+// per channel. they return the rows in which some pixel changed; a row where nothing changed has settled
+// (like lerp(), the fade can stop one short of its target) and stays that way until it is drawn to
+const uint32_t FADE_WHITE = 0xFFFFFFFF;
+const uint32_t FADE_BLACK = 0x000000FF;
+
+// indexed by plane 2 bit << 1 | plane 1 bit; plain CHIP-8 only ever uses the first two
+const uint32_t PALETTE[4] = {FADE_BLACK, FADE_WHITE, 0x555555FF, 0xAAAAAAFF};
+
+uint32_t fade_weight(float lerp_rate)
+{
+    const int32_t t = (int32_t)(lerp_rate * 256 + 0.5f);
+    return t < 0 ? 0 : t > 256 ? 256 : t;
+}
+
+uint64_t fade_scalar(uint32_t *colors, const Bitplane *planes, uint32_t t, uint64_t row_mask)
+{
+    uint64_t fading = 0;
+
+    for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+    {
+        if (!((row_mask >> y) & 1))
+            continue;
+
+        for (uint32_t x = 0; x < HIRES_WIDTH; ++x)
+        {
+            uint32_t &color = colors[y * HIRES_WIDTH + x];
+            const uint32_t shift = 63 - x % 64;
+            const uint32_t target = PALETTE[((planes[0][y][x / 64] >> shift) & 1) | ((planes[1][y][x / 64] >> shift) & 1) << 1];
+
+            uint32_t result = 0;
+            for (uint32_t channel = 0; channel < 32; channel += 8)
+            {
+                const uint32_t c = (color >> channel) & 0xFF;
+                const uint32_t goal = (target >> channel) & 0xFF;
+                result |= ((c * (256 - t) + goal * t) >> 8) << channel;
+            }
+
+            if (color != result)
+                fading |= 1ull << y;
+            color = result;
+        }
+    }
+
+    return fading;
+}
+
+#ifdef CHIP8_X86
+// 4 pixels per step; the 16-bit sums can't overflow since the two weights add up to 256
+uint64_t fade_sse2(uint32_t *colors, const Bitplane *planes, uint32_t t, uint64_t row_mask)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weight = _mm_set1_epi16(t);
+    const __m128i inverse_weight = _mm_set1_epi16(256 - t);
+    const __m128i palette[4] = {_mm_set1_epi32(PALETTE[0]), _mm_set1_epi32(PALETTE[1]), _mm_set1_epi32(PALETTE[2]), _mm_set1_epi32(PALETTE[3])};
+    // lane i holds the bit of pixel x + i inside the nibble taken from the row
+    const __m128i lane_bits = _mm_set_epi32(1, 2, 4, 8);
+
+    uint64_t fading = 0;
+
+    for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+    {
+        if (!((row_mask >> y) & 1))
+            continue;
+
+        __m128i settled = _mm_set1_epi32(-1);
+
+        for (uint32_t x = 0; x < HIRES_WIDTH; x += 4)
+        {
+            __m128i *pixels = (__m128i *)&colors[y * HIRES_WIDTH + x];
+            const uint32_t shift = 60 - x % 64;
+            const int low_plane = (planes[0][y][x / 64] >> shift) & 0xF;
+            const int high_plane = (planes[1][y][x / 64] >> shift) & 0xF;
+
+            // pick the palette entry per lane: first by the plane 1 bit, then by the plane 2 bit
+            const __m128i lit_low = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(low_plane), lane_bits), lane_bits);
+            const __m128i lit_high = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(high_plane), lane_bits), lane_bits);
+            const __m128i unset = _mm_or_si128(_mm_and_si128(lit_low, palette[1]), _mm_andnot_si128(lit_low, palette[0]));
+            const __m128i set = _mm_or_si128(_mm_and_si128(lit_low, palette[3]), _mm_andnot_si128(lit_low, palette[2]));
+            const __m128i target = _mm_or_si128(_mm_and_si128(lit_high, set), _mm_andnot_si128(lit_high, unset));
+            const __m128i color = _mm_loadu_si128(pixels);
+
+            const __m128i low = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(color, zero), inverse_weight),
+                                                             _mm_mullo_epi16(_mm_unpacklo_epi8(target, zero), weight)),
+                                               8);
+            const __m128i high = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(color, zero), inverse_weight),
+                                                              _mm_mullo_epi16(_mm_unpackhi_epi8(target, zero), weight)),
+                                                8);
+
+            const __m128i result = _mm_packus_epi16(low, high);
+            _mm_storeu_si128(pixels, result);
+            settled = _mm_and_si128(settled, _mm_cmpeq_epi32(result, color));
+        }
+
+        if (_mm_movemask_epi8(settled) != 0xFFFF)
+            fading |= 1ull << y;
+    }
+
+    return fading;
+}
+
+// same as fade_sse2 with 8 pixels per step; unpack and pack both work inside 128-bit lanes so pixel order is kept
+__attribute__((target("avx2"))) uint64_t fade_avx2(uint32_t *colors, const Bitplane *planes, uint32_t t, uint64_t row_mask)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weight = _mm256_set1_epi16(t);
+    const __m256i inverse_weight = _mm256_set1_epi16(256 - t);
+    const __m256i palette[4] = {_mm256_set1_epi32(PALETTE[0]), _mm256_set1_epi32(PALETTE[1]), _mm256_set1_epi32(PALETTE[2]), _mm256_set1_epi32(PALETTE[3])};
+    const __m256i lane_bits = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+
+    uint64_t fading = 0;
+
+    for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+    {
+        if (!((row_mask >> y) & 1))
+            continue;
+
+        __m256i settled = _mm256_set1_epi32(-1);
+
+        for (uint32_t x = 0; x < HIRES_WIDTH; x += 8)
+        {
+            __m256i *pixels = (__m256i *)&colors[y * HIRES_WIDTH + x];
+            const uint32_t shift = 56 - x % 64;
+            const int low_plane = (planes[0][y][x / 64] >> shift) & 0xFF;
+            const int high_plane = (planes[1][y][x / 64] >> shift) & 0xFF;
+
+            const __m256i lit_low = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(low_plane), lane_bits), lane_bits);
+            const __m256i lit_high = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(high_plane), lane_bits), lane_bits);
+            const __m256i unset = _mm256_blendv_epi8(palette[0], palette[1], lit_low);
+            const __m256i set = _mm256_blendv_epi8(palette[2], palette[3], lit_low);
+            const __m256i target = _mm256_blendv_epi8(unset, set, lit_high);
+            const __m256i color = _mm256_loadu_si256(pixels);
+
+            const __m256i low = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(color, zero), inverse_weight),
+                                                                   _mm256_mullo_epi16(_mm256_unpacklo_epi8(target, zero), weight)),
+                                                  8);
+            const __m256i high = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(color, zero), inverse_weight),
+                                                                    _mm256_mullo_epi16(_mm256_unpackhi_epi8(target, zero), weight)),
+                                                   8);
+
+            const __m256i result = _mm256_packus_epi16(low, high);
+            _mm256_storeu_si256(pixels, result);
+            settled = _mm256_and_si256(settled, _mm256_cmpeq_epi32(result, color));
+        }
+
+        if ((uint32_t)_mm256_movemask_epi8(settled) != 0xFFFFFFFF)
+            fading |= 1ull << y;
+    }
+
+    return fading;
+}
+#endif
+
+typedef uint64_t (*FadeKernel)(uint32_t *colors, const Bitplane *planes, uint32_t t, uint64_t row_mask);
+
+// widest kernel the cpu supports, picked once at startup
+FadeKernel select_fade_kernel()
+{
+#ifdef CHIP8_X86
+    // this runs during static initialization, possibly before libgcc has probed the cpu
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return fade_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return fade_sse2;
+#endif
+    return fade_scalar;
+}
+
+const FadeKernel fade_pixels = select_fade_kernel();
+
+bool CaptureWriter::open(const char *name)
+{
+    video_name = std::string(name) + ".y4m";
+    audio_name = std::string(name) + ".wav";
+    video = fopen(video_name.c_str(), "wb");
+    audio = fopen(audio_name.c_str(), "wb");
+    if (!video || !audio)
+    {
+        fprintf(stderr, "Could not open capture file %s\n", (video ? audio_name : video_name).c_str());
+        if (video)
+            fclose(video);
+        if (audio)
+            fclose(audio);
+        video = audio = nullptr;
+        return false;
+    }
+
+    fprintf(video, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 Cmono\n", HIRES_WIDTH, HIRES_HEIGHT, FPS);
+    write_wav_header();
+    writer = std::thread(&CaptureWriter::run, this);
+    return true;
+}
+
+void CaptureWriter::push(const Frame &frame, const int16_t *samples, bool wait)
+{
+    const uint32_t write = write_index.load(std::memory_order_relaxed);
+    while (write - read_index.load(std::memory_order_acquire) >= SLOTS)
+    {
+        if (!wait)
+        {
+            pending_drops++;
+            dropped++;
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    Slot &slot = slots[write % SLOTS];
+    memcpy(slot.planes, frame.planes, sizeof slot.planes);
+    memcpy(slot.samples, samples, sizeof slot.samples);
+    slot.dropped = pending_drops;
+    pending_drops = 0;
+    write_index.store(write + 1, std::memory_order_release);
+    ready.notify_one();
+}
+
+void CaptureWriter::run()
+{
+    for (;;)
+    {
+        const uint32_t read = read_index.load(std::memory_order_relaxed);
+        if (read == write_index.load(std::memory_order_acquire))
+        {
+            if (stopping.load(std::memory_order_acquire) && read == write_index.load(std::memory_order_acquire))
+                return;
+
+            // push doesn't take the lock, so a wakeup can slip past; the timeout bounds how long that costs
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait_for(lock, std::chrono::milliseconds(20));
+            continue;
+        }
+
+        const Slot &slot = slots[read % SLOTS];
+        for (uint32_t i = 0; i < slot.dropped; ++i)
+            write_frame(nullptr);
+        write_frame(&slot);
+        read_index.store(read + 1, std::memory_order_release);
+    }
+}
+
+// one frame of each stream; no slot repeats the last picture with silence
+void CaptureWriter::write_frame(const Slot *slot)
+{
+    static const int16_t silence[SAMPLES_PER_FRAME] = {};
+
+    if (slot)
+    {
+        for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+        {
+            for (uint32_t x = 0; x < HIRES_WIDTH; ++x)
+            {
+                const uint32_t shift = 63 - x % 64;
+                const uint32_t color = PALETTE[((slot->planes[0][y][x / 64] >> shift) & 1) | ((slot->planes[1][y][x / 64] >> shift) & 1) << 1];
+                // the palette is grey, so any channel will do as the luma
+                picture[y * HIRES_WIDTH + x] = color >> 24;
+            }
+        }
+    }
+
+    const int16_t *samples = slot ? slot->samples : silence;
+    failed |= fputs("FRAME\n", video) < 0 || fwrite(picture, sizeof picture, 1, video) != 1 ||
+              fwrite(samples, sizeof silence, 1, audio) != 1;
+    audio_bytes += sizeof silence;
+    written++;
+}
+
+// a canonical 44 byte header; the two sizes are filled in again once the length is known
+void CaptureWriter::write_wav_header()
+{
+    const auto put = [&](uint32_t value, uint32_t bytes)
+    {
+        for (uint32_t i = 0; i < bytes; ++i)
+            fputc(value >> (8 * i) & 0xFF, audio);
+    };
+
+    fputs("RIFF", audio);
+    put(36 + audio_bytes, 4);
+    fputs("WAVEfmt ", audio);
+    put(16, 4);
+    put(1, 2); // pcm
+    put(1, 2); // mono
+    put(AUDIO_SAMPLE_RATE, 4);
+    put(AUDIO_SAMPLE_RATE * 2, 4);
+    put(2, 2);
+    put(16, 2);
+    fputs("data", audio);
+    put(audio_bytes, 4);
+}
+
+bool CaptureWriter::close()
+{
+    if (!video && !audio)
+        return true;
+
+    if (writer.joinable())
+    {
+        stopping.store(true, std::memory_order_release);
+        ready.notify_one();
+        writer.join();
+    }
+
+    if (audio && fseek(audio, 0, SEEK_SET) == 0)
+        write_wav_header();
+
+    failed |= (video && fclose(video) != 0) | (audio && fclose(audio) != 0);
+    video = audio = nullptr;
+
+    fprintf(stderr, "capture: %llu frames to %s and %s, %llu dropped%s\n", (unsigned long long)written, video_name.c_str(),
+            audio_name.c_str(), (unsigned long long)dropped, failed ? ", write errors" : "");
+    return !failed;
+}
+
+void Screen::handle_input(const SDL_Event &e)
+{
+    if (e.type == SDL_WINDOWEVENT)
+    {
+        needs_redraw = true;
+        grid_stale = true;
+    }
+    else if (e.type == SDL_KEYDOWN)
+    {
+        switch (e.key.keysym.sym)
+        {
+        case SDLK_n:
+            if (lerp_rate < 1.0)
+                lerp_rate += 0.1;
+            fading_rows = ALL_ROWS;
+            break;
+
+        case SDLK_m:
+            if (lerp_rate > 0.1)
+                lerp_rate -= 0.1;
+            fading_rows = ALL_ROWS;
+            break;
+
+        case SDLK_g:
+            pixel_grid = !pixel_grid;
+            needs_redraw = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+// outlines every chip8 pixel at the renderer's output size. the lines are opaque black, so over unlit
+// pixels they vanish into the background and only lit ones show a grid
+void Screen::bake_grid(SDL_Renderer *renderer)
+{
+    release();
+    grid_stale = false;
+    grid_hires = hires;
+
+    int width, height;
+    if (SDL_GetRendererOutputSize(renderer, &width, &height) != 0 || width <= 0 || height <= 0)
+        return;
+
+    grid = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, width, height);
+    if (!grid)
+    {
+        SDL_Log("Failed To Create SDL Texture %s\n", SDL_GetError());
+        return;
+    }
+    SDL_SetTextureBlendMode(grid, SDL_BLENDMODE_BLEND);
+
+    // a line on the first and last window pixel of every cell, as SDL_RenderDrawRect would draw it
+    const int64_t columns = hires ? HIRES_WIDTH : DISPLAY_WIDTH;
+    const int64_t rows = hires ? HIRES_HEIGHT : DISPLAY_HEIGHT;
+    const auto edge = [](int64_t i, int64_t cells, int64_t size)
+    {
+        return i == 0 || i == size - 1 || (i - 1) * cells / size != i * cells / size ||
+               i * cells / size != (i + 1) * cells / size;
+    };
+
+    std::vector<uint32_t> pixels((size_t)width * height, 0);
+    for (int y = 0; y < height; ++y)
+    {
+        const bool row_edge = edge(y, rows, height);
+        for (int x = 0; x < width; ++x)
+        {
+            if (row_edge || edge(x, columns, width))
+                pixels[(size_t)y * width + x] = FADE_BLACK;
+        }
+    }
+
+    SDL_UpdateTexture(grid, nullptr, pixels.data(), width * sizeof(uint32_t));
+}
+
+void Screen::release()
+{
+    if (grid)
+        SDL_DestroyTexture(grid);
+    grid = nullptr;
+}
+
+// fades pixel_color towards the frame, then uploads it to the streaming texture in one go and lets the
+// renderer scale it up to the window. the pixel grid is one more copy of a texture baked beforehand.
+// only rows drawn to or still fading get faded, and when there are none the frame isn't presented at all
+void Screen::update_screen(SDL_Renderer **renderer, SDL_Texture *texture, const Frame &frame)
+{
+    const uint64_t rows = frame.dirty_rows | fading_rows;
+
+    if (!rows && !needs_redraw && frame.hires == hires)
+        return;
+
+    memcpy(planes, frame.planes, sizeof planes);
+    hires = frame.hires;
+    fading_rows = fade_pixels(pixel_color, planes, fade_weight(lerp_rate), rows);
+    needs_redraw = false;
+
+    // a plain repaint can reuse what the texture already holds
+    void *pixels;
+    int pitch;
+    if (rows && SDL_LockTexture(texture, nullptr, &pixels, &pitch) == 0)
+    {
+        for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+            memcpy((uint8_t *)pixels + y * pitch, &pixel_color[y * HIRES_WIDTH], HIRES_WIDTH * sizeof pixel_color[0]);
+
+        SDL_UnlockTexture(texture);
+    }
+
+    SDL_RenderCopy(*renderer, texture, nullptr, nullptr);
+
+    if (pixel_grid)
+    {
+        // only rebuilt when the window or the resolution changes
+        if (grid_stale || grid_hires != hires)
+            bake_grid(*renderer);
+        if (grid)
+            SDL_RenderCopy(*renderer, grid, nullptr, nullptr);
+    }
+
+    SDL_RenderPresent(*renderer);
+}
+
+void Chip8::tick_timers()
+{
+    if (delay_timer)
+        delay_timer--;
+
+    if (sound_timer)
+        sound_timer--;
+
+    frame_start_cycle = cycles;
+    beeper_at_frame_start = sound_timer > 0;
+    beeper_edge_count = 0;
+}
+
+// FX18, remembering when the beeper goes on or off so the frame's audio can switch at that point
+void Chip8::set_sound_timer(uint8_t value)
+{
+    if ((value > 0) != (sound_timer > 0) && beeper_edge_count < MAX_BEEPER_EDGES)
+        beeper_edges[beeper_edge_count++] = {cycles - 1, value > 0};
+
+    sound_timer = value;
+    side_effects++;
+}
+
+// bit k of mask is the state of key k
+void Chip8::set_keypad(uint16_t mask)
+{
+    // a loop polling the keys may take another path now
+    if (mask != keypad_mask())
+        last_jump.valid = false;
+
+    for (uint8_t i = 0; i < KEY_COUNT; ++i)
+        keypad[i] = (mask >> i) & 1;
+}
+
+// one xorshift32 step per CXNN, the top byte of the state
+uint8_t Chip8::random_byte()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state >> 24;
+}
+
+// FNV-1a over the framebuffer, one byte per pixel in row-major order at the current resolution. the second
+// plane only counts once it has been drawn to, so a plain CHIP-8 screen hashes the same as it always has
+uint32_t Chip8::display_hash() const
+{
+    bool second_plane = false;
+    for (uint32_t y = 0; y < height(); ++y)
+        second_plane |= (display[1][y][0] | display[1][y][1]) != 0;
+
+    uint32_t hash = 2166136261u;
+    for (uint32_t plane = 0; plane < (second_plane ? 2u : 1u); ++plane)
+    {
+        for (uint32_t y = 0; y < height(); ++y)
+        {
+            for (uint32_t x = 0; x < width(); ++x)
+            {
+                hash ^= pixel(x, y, plane);
+                hash *= 16777619u;
+            }
+        }
+    }
+    return hash;
+}
+
+// bit k is the state of key k
+uint16_t Chip8::keypad_mask() const
+{
+    uint16_t mask = 0;
+    for (uint8_t i = 0; i < KEY_COUNT; ++i)
+        mask |= keypad[i] << i;
+    return mask;
+}
+
+void Chip8::save_state(Snapshot &snapshot) const
+{
+    snapshot.magic = SNAPSHOT_MAGIC;
+    snapshot.version = SNAPSHOT_VERSION;
+    snapshot.index = index;
+    snapshot.cycles = cycles;
+    memcpy(snapshot.display, display, sizeof display);
+    snapshot.pc = pc;
+    snapshot.keypad = keypad_mask();
+    memcpy(snapshot.stack, stack, sizeof stack);
+    snapshot.stack_depth = stack_ptr - stack;
+    snapshot.delay_timer = delay_timer;
+    snapshot.sound_timer = sound_timer;
+    snapshot.waiting_key = waiting_key;
+    snapshot.any_key_pressed = any_key_pressed;
+    snapshot.hires = hires;
+    snapshot.planes = planes;
+    snapshot.pitch = pitch;
+    snapshot.pattern_audio = pattern_audio;
+    memset(snapshot.reserved, 0, sizeof snapshot.reserved);
+    snapshot.memory_size = memory.size();
+    snapshot.random_state = random_state;
+    memcpy(snapshot.flags, flags, sizeof flags);
+    memcpy(snapshot.audio_pattern, audio_pattern, sizeof audio_pattern);
+    memcpy(snapshot.registers, registers, sizeof registers);
+    memcpy(snapshot.memory, memory.data(), memory.size());
+}
+
+bool Chip8::load_state(const Snapshot &snapshot)
+{
+    if (snapshot.magic != SNAPSHOT_MAGIC || snapshot.version != SNAPSHOT_VERSION || snapshot.stack_depth > STACK_SIZE)
+        return false;
+
+    // everything below indexes arrays or selects code paths, so a damaged file must not get that far.
+    // every pitch byte is a valid FX3A pitch
+    if ((snapshot.waiting_key >= KEY_COUNT && snapshot.waiting_key != 0xFF) || snapshot.planes > 3 ||
+        snapshot.hires > 1 || snapshot.any_key_pressed > 1 || snapshot.pattern_audio > 1)
+        return false;
+
+    // a snapshot of a machine with another amount of memory belongs to another profile or rom
+    if (snapshot.memory_size != memory.size())
+        return false;
+
+    // only re-decode the parts of memory that differ, so restoring into a running game stays cheap
+    const uint16_t CHUNK = 64;
+    for (uint32_t address = 0; address < memory.size(); address += CHUNK)
+    {
+        if (memcmp(&memory[address], &snapshot.memory[address], CHUNK) != 0)
+        {
+            memcpy(&memory[address], &snapshot.memory[address], CHUNK);
+            invalidate(address, CHUNK);
+        }
+    }
+
+    index = snapshot.index;
+    cycles = snapshot.cycles;
+    memcpy(display, snapshot.display, sizeof display);
+    dirty_rows = ALL_ROWS;
+    pc = snapshot.pc;
+    set_keypad(snapshot.keypad);
+    memcpy(stack, snapshot.stack, sizeof stack);
+    stack_ptr = &stack[snapshot.stack_depth];
+    delay_timer = snapshot.delay_timer;
+    sound_timer = snapshot.sound_timer;
+    waiting_key = snapshot.waiting_key;
+    any_key_pressed = snapshot.any_key_pressed;
+    hires = snapshot.hires;
+    planes = snapshot.planes;
+    pitch = snapshot.pitch;
+    pattern_audio = snapshot.pattern_audio;
+    random_state = snapshot.random_state;
+    memcpy(flags, snapshot.flags, sizeof flags);
+    memcpy(audio_pattern, snapshot.audio_pattern, sizeof audio_pattern);
+    memcpy(registers, snapshot.registers, sizeof registers);
+
+    frame_start_cycle = cycles;
+    beeper_at_frame_start = sound_timer > 0;
+    beeper_edge_count = 0;
+    last_jump.valid = false;
+    return true;
+}
+
+// writes the difference between current and snapshot to delta as runs of
+// (uint16 zero words, uint16 literal words, literal words...), and brings current up to snapshot by
+// storing only the words that differ
+uint32_t RewindBuffer::encode(const Snapshot &snapshot)
+{
+    uint8_t *from = (uint8_t *)&current;
+    const uint8_t *to = (const uint8_t *)&snapshot;
+    // push() only diffs snapshots of the same size, and memory beyond that size isn't part of them
+    const uint32_t WORDS = snapshot_size(snapshot) / sizeof(uint64_t);
+    uint32_t length = 0;
+    uint32_t word = 0;
+
+    while (word < WORDS)
+    {
+        uint64_t a, b;
+        uint16_t zeros = 0;
+        // most of memory is unchanged, so skip it a cache line at a time first
+        while (word + 8 <= WORDS && !memcmp(from + word * 8, to + word * 8, 64))
+        {
+            word += 8;
+            zeros += 8;
+        }
+        for (; word < WORDS; ++word, ++zeros)
+        {
+            memcpy(&a, from + word * 8, 8);
+            memcpy(&b, to + word * 8, 8);
+            if (a != b)
+                break;
+        }
+
+        uint8_t *header = &delta[length];
+        uint16_t literals = 0;
+        length += 4;
+        for (; word < WORDS; ++word, ++literals)
+        {
+            memcpy(&a, from + word * 8, 8);
+            memcpy(&b, to + word * 8, 8);
+            if (a == b)
+                break;
+            memcpy(from + word * 8, &b, 8);
+            a ^= b;
+            memcpy(&delta[length], &a, 8);
+            length += 8;
+        }
+
+        memcpy(header, &zeros, 2);
+        memcpy(header + 2, &literals, 2);
+    }
+
+    return length;
+}
+
+void RewindBuffer::apply(const uint8_t *data)
+{
+    uint8_t *to = (uint8_t *)&current;
+    const uint32_t WORDS = snapshot_size(current) / sizeof(uint64_t);
+    uint32_t word = 0;
+
+    while (word < WORDS)
+    {
+        uint16_t zeros, literals;
+        memcpy(&zeros, data, 2);
+        memcpy(&literals, data + 2, 2);
+        data += 4;
+        word += zeros;
+
+        for (; literals; --literals, ++word, data += 8)
+        {
+            uint64_t a, b;
+            memcpy(&a, to + word * 8, 8);
+            memcpy(&b, data, 8);
+            a ^= b;
+            memcpy(to + word * 8, &a, 8);
+        }
+    }
+}
+
+void RewindBuffer::push(const Snapshot &snapshot)
+{
+    // a machine with a different amount of memory starts a new history
+    if (!has_current || snapshot.memory_size != current.memory_size)
+    {
+        entries.clear();
+        head = 0;
+        memcpy(&current, &snapshot, snapshot_size(snapshot));
+        has_current = true;
+        return;
+    }
+
+    const uint32_t length = encode(snapshot);
+    if (length > storage.size())
+    {
+        entries.clear();
+        head = 0;
+        return;
+    }
+
+    // wrap around, dropping the oldest deltas that sit in the unused tail
+    if (head + length > storage.size())
+    {
+        while (!entries.empty() && entries.front().offset >= head)
+            entries.pop_front();
+        head = 0;
+    }
+
+    while (!entries.empty() && entries.front().offset >= head && entries.front().offset < head + length)
+        entries.pop_front();
+
+    memcpy(&storage[head], delta, length);
+    entries.push_back({head, length});
+    head += length;
+}
+
+bool RewindBuffer::step_back(Snapshot &snapshot)
+{
+    if (entries.empty())
+        return false;
+
+    const Entry entry = entries.back();
+    entries.pop_back();
+    apply(&storage[entry.offset]);
+    head = entry.offset;
+
+    memcpy(&snapshot, &current, snapshot_size(current));
+    return true;
+}
+
+// queues the audio of the frame that just ran, then starts the next one
+void Chip8::update_timers(int16_t *samples)
+{
+    synthesize_audio(samples, SAMPLES_PER_FRAME);
+    tick_timers();
+}
+
+// spreads 32 bits over 64, every bit doubled
+uint64_t double_bits(uint32_t bits)
+{
+    uint64_t x = bits;
+    x = (x | x << 16) & 0x0000FFFF0000FFFFull;
+    x = (x | x << 8) & 0x00FF00FF00FF00FFull;
+    x = (x | x << 4) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | x << 2) & 0x3333333333333333ull;
+    x = (x | x << 1) & 0x5555555555555555ull;
+    return x | x << 1;
+}
+
+// hands the framebuffer to the renderer along with the rows drawn to since the last time
+void Chip8::publish(Frame &frame)
+{
+    if (hires)
+        memcpy(frame.planes, display, sizeof display);
+
+    for (uint32_t plane = 0; !hires && plane < PLANE_COUNT; ++plane)
+    {
+        for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+        {
+            const uint64_t row = display[plane][y / 2][0];
+            frame.planes[plane][y][0] = double_bits(row >> 32);
+            frame.planes[plane][y][1] = double_bits((uint32_t)row);
+        }
+    }
+
+    // lores row y covers hires rows 2y and 2y + 1
+    frame.dirty_rows |= hires ? dirty_rows : double_bits(dirty_rows);
+    frame.hires = hires;
+    dirty_rows = 0;
+}
+
+void Chip8::clear_screen()
+{
+    side_effects++;
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!((planes >> plane) & 1))
+            continue;
+
+        for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+        {
+            if (display[plane][y][0] | display[plane][y][1])
+                dirty_rows |= 1ull << y;
+            display[plane][y][0] = 0;
+            display[plane][y][1] = 0;
+        }
+    }
+}
+
+// 00FE and 00FF: switching resolution clears every plane, like Octo
+void Chip8::set_resolution(bool high)
+{
+    hires = high;
+    side_effects++;
+    memset(display, 0, sizeof display);
+    dirty_rows = ALL_ROWS;
+}
+
+// vertical scrolls move whole rows of the selected planes, horizontal ones shift each row; both count in
+// pixels of the current resolution
+void Chip8::scroll_down(uint8_t N)
+{
+    side_effects++;
+    const uint32_t rows = height();
+    const uint32_t n = N < rows ? N : rows;
+
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!((planes >> plane) & 1))
+            continue;
+        memmove(&display[plane][n], &display[plane][0], (rows - n) * sizeof display[plane][0]);
+        memset(&display[plane][0], 0, n * sizeof display[plane][0]);
+    }
+
+    dirty_rows = ALL_ROWS;
+}
+
+void Chip8::scroll_up(uint8_t N)
+{
+    side_effects++;
+    const uint32_t rows = height();
+    const uint32_t n = N < rows ? N : rows;
+
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!((planes >> plane) & 1))
+            continue;
+        memmove(&display[plane][0], &display[plane][n], (rows - n) * sizeof display[plane][0]);
+        memset(&display[plane][rows - n], 0, n * sizeof display[plane][0]);
+    }
+
+    dirty_rows = ALL_ROWS;
+}
+
+void Chip8::scroll_right()
+{
+    side_effects++;
+    // lores pixels shifted out of word 0 fall off the screen
+    const uint64_t right_half = hires ? ~0ull : 0;
+
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!((planes >> plane) & 1))
+            continue;
+        for (uint32_t y = 0; y < height(); ++y)
+        {
+            uint64_t *row = display[plane][y];
+            row[1] = (row[1] >> 4 | row[0] << 60) & right_half;
+            row[0] >>= 4;
+        }
+    }
+
+    dirty_rows = ALL_ROWS;
+}
+
+void Chip8::scroll_left()
+{
+    side_effects++;
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!((planes >> plane) & 1))
+            continue;
+        for (uint32_t y = 0; y < height(); ++y)
+        {
+            uint64_t *row = display[plane][y];
+            row[0] = row[0] << 4 | row[1] >> 60;
+            row[1] <<= 4;
+        }
+    }
+
+    dirty_rows = ALL_ROWS;
+}
+
+// 00FD: stop, and keep pc on the instruction so nothing after it runs
+void Chip8::exit_interpreter()
+{
+    state = QUIT;
+    pc -= 2;
+}
+
+// 5XY2: store VX to VY (in either order) at I, leaving I alone
+void Chip8::store_range(uint8_t X, uint8_t Y)
+{
+    const uint8_t count = (X < Y ? Y - X : X - Y) + 1;
+    const int8_t step = X < Y ? 1 : -1;
+
+    for (uint8_t i = 0; i < count; ++i)
+        memory[(index + i) & memory_mask] = registers[X + i * step];
+
+    invalidate(index, count);
+}
+
+// 5XY3: load VX to VY (in either order) from I, leaving I alone
+void Chip8::load_range(uint8_t X, uint8_t Y)
+{
+    const uint8_t count = (X < Y ? Y - X : X - Y) + 1;
+    const int8_t step = X < Y ? 1 : -1;
+
+    for (uint8_t i = 0; i < count; ++i)
+        registers[X + i * step] = memory[(index + i) & memory_mask];
+}
+
+// F000 NNNN: I = NNNN, the only four byte instruction
+void Chip8::load_long_index()
+{
+    index = next_opcode();
+    pc += 2;
+}
+
+// F002: the 16 bytes at I become the audio pattern
+void Chip8::load_audio_pattern()
+{
+    for (uint32_t i = 0; i < AUDIO_PATTERN_SIZE; ++i)
+        audio_pattern[i] = memory[(index + i) & memory_mask];
+    pattern_audio = true;
+    side_effects++;
+}
+
+// each sprite row is shifted into place as a whole word: the AND finds collisions and the XOR draws it.
+// pixels shifted past the right edge fall off, rows past the bottom edge are skipped
+template <typename Quirks>
+void Chip8::draw_sprite(uint8_t X, uint8_t Y, uint8_t N)
+{
+    const uint32_t screen_width = width();
+    const uint32_t screen_height = height();
+    const uint32_t posX = registers[X] % screen_width;
+    const uint32_t posY = registers[Y] % screen_height;
+    // DXY0 draws a 16x16 sprite of two bytes per line, and nothing before SUPER-CHIP
+    const bool big = Quirks::schip && N == 0;
+    const uint32_t sprite_width = big ? 16 : 8;
+    const uint32_t lines = big ? 16 : N;
+    const uint32_t rows = Quirks::wrap_sprites || posY + lines <= screen_height ? lines : screen_height - posY;
+    // lores only has word 0 of each row
+    const uint64_t right_half = hires ? ~0ull : 0;
+    const bool wraps = Quirks::wrap_sprites && posX + sprite_width > screen_width;
+
+    uint64_t collision = 0;
+    // each selected plane reads the next sprite in memory
+    uint16_t address = index;
+    side_effects++;
+
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+    {
+        if (!((planes >> plane) & 1))
+            continue;
+
+        for (uint32_t i = 0; i < rows; ++i)
+        {
+            const uint16_t line = address + i * sprite_width / 8;
+            const uint32_t bits = sprite_width == 16 ? memory[line & memory_mask] << 8 | memory[(line + 1) & memory_mask]
+                                                     : memory[line & memory_mask];
+            const uint64_t sprite = (uint64_t)bits << (64 - sprite_width);
+            // the sprite shifted across the two words of the row; wrapping brings the bits that fall off the
+            // right edge back in on the left, which is always in word 0
+            uint64_t left = posX < 64 ? sprite >> posX : 0;
+            uint64_t right = posX < 64 ? (posX ? sprite << (64 - posX) : 0) : sprite >> (posX - 64);
+            if (wraps)
+                left |= sprite << (screen_width - posX);
+            right &= right_half;
+
+            uint64_t *row = display[plane][(posY + i) % screen_height];
+            collision |= (row[0] & left) | (row[1] & right);
+            row[0] ^= left;
+            row[1] ^= right;
+            if (left | right)
+                dirty_rows |= 1ull << (posY + i) % screen_height;
+        }
+
+        address += lines * sprite_width / 8;
+    }
+
+    registers[0xF] = collision != 0;
+}
+
+// FX0A. the keypad only changes between frames, so while it keeps waiting nothing can happen until then:
+// the rest of the frame is skipped as an idle loop of one instruction
+void Chip8::wait_for_key(uint8_t X)
+{
+    for (uint8_t i = 0; waiting_key == 0xFF && i < sizeof keypad; ++i)
+    {
+        if (keypad[i])
+        {
+            waiting_key = i;
+            any_key_pressed = true;
+            side_effects++;
+            break;
+        }
+    }
+    if (!any_key_pressed)
+    {
+        pc -= 2;
+        idle_period = !TRACE_ENABLED;
+    }
+    else
+    {
+        // wait until key is released
+        if (keypad[waiting_key])
+        {
+            pc -= 2;
+            idle_period = !TRACE_ENABLED;
+        }
+        else
+        {
+            // it has been released
+            registers[X] = waiting_key;
+            waiting_key = 0xFF; // reset to not found
+            any_key_pressed = false;
+            side_effects++;
+        }
+    }
+}
+
+// 1NNN. jumping back to where the last backward jump in this frame went from, with the registers, I, stack
+// depth, timers and random state as they were and nothing written since, closes a loop that will repeat
+// exactly until a timer ticks or a key changes, and both only happen between frames. the cores then
+// fast-forward over the whole iterations left in the frame. tracing sees every instruction, so it never skips
+void Chip8::jump(uint16_t address)
+{
+    if (!TRACE_ENABLED && address < pc)
+    {
+        const uint8_t depth = stack_ptr - stack;
+        if (last_jump.valid && last_jump.pc == pc && last_jump.cycles >= frame_start_cycle && last_jump.side_effects == side_effects &&
+            last_jump.random_state == random_state && last_jump.index == index && last_jump.depth == depth &&
+            last_jump.delay_timer == delay_timer && memcmp(last_jump.registers, registers, sizeof registers) == 0)
+        {
+            idle_period = cycles - last_jump.cycles;
+        }
+        else
+        {
+            last_jump.valid = true;
+            last_jump.pc = pc;
+            last_jump.side_effects = side_effects;
+            last_jump.random_state = random_state;
+            last_jump.index = index;
+            last_jump.depth = depth;
+            last_jump.delay_timer = delay_timer;
+            memcpy(last_jump.registers, registers, sizeof registers);
+        }
+        last_jump.cycles = cycles;
+    }
+
+    pc = address;
+}
+
+// skips the whole iterations of the idle loop just found that still fit in this run. each would leave the
+// machine exactly as it is, so only cycles move; the last partial iteration runs for real
+uint32_t Chip8::skip_idle(uint32_t remaining)
+{
+    const uint32_t skipped = remaining - remaining % idle_period;
+    cycles += skipped;
+    last_jump.cycles += skipped;
+    idle_skipped += skipped;
+    idle_period = 0;
+    return skipped;
+}
+
+void Chip8::store_bcd(uint8_t X)
+{
+    uint8_t bcd = registers[X];
+    memory[(index + 2) & memory_mask] = bcd % 10;
+    bcd /= 10;
+    memory[(index + 1) & memory_mask] = bcd % 10;
+    bcd /= 10;
+    memory[index & memory_mask] = bcd;
+
+    invalidate(index, 3);
+}
+
+template <typename Quirks>
+void Chip8::store_registers(uint8_t X)
+{
+    for (uint8_t i = 0; i <= X; ++i)
+    {
+        memory[(index + i) & memory_mask] = registers[i];
+    }
+
+    invalidate(index, X + 1);
+
+    if (Quirks::index != INDEX_UNCHANGED)
+        index += Quirks::index == INDEX_ADVANCES ? X + 1 : X;
+}
+
+template <typename Quirks>
+void Chip8::load_registers(uint8_t X)
+{
+    for (uint8_t i = 0; i <= X; ++i)
+    {
+        registers[i] = memory[(index + i) & memory_mask];
+    }
+
+    if (Quirks::index != INDEX_UNCHANGED)
+        index += Quirks::index == INDEX_ADVANCES ? X + 1 : X;
+}
+
+template <typename Quirks>
+void Chip8::add_to_index(uint8_t X)
+{
+    const uint32_t sum = index + registers[X];
+    index = sum;
+
+    if (Quirks::index_overflow)
+        registers[0xF] = sum > 0xFFF;
+}
+
+void Chip8::emulate_instruction()
+{
+    switch (profile)
+    {
+    case PROFILE_CHIP48:
+        execute_instruction<QuirksCHIP48>();
+        break;
+    case PROFILE_SCHIP:
+        execute_instruction<QuirksSCHIP>();
+        break;
+    case PROFILE_MODERN:
+        execute_instruction<QuirksModern>();
+        break;
+    case PROFILE_AMIGA:
+        execute_instruction<QuirksAmiga>();
+        break;
+    default:
+        execute_instruction<QuirksVIP>();
+        break;
+    }
+}
+
+template <typename Quirks>
+void Chip8::execute_instruction()
+{
+    opcode = next_opcode();
+    tracer.record(pc, opcode, index, registers);
+    pc += 2;
+    cycles++;
+
+    uint16_t NNN = opcode & 0x0FFF;
+    uint8_t NN = opcode & 0x0FF;
+    uint8_t N = opcode & 0x0F;
+    uint8_t X = (opcode >> 8) & 0x0F;
+    uint8_t Y = (opcode >> 4) & 0x0F;
+
+    switch ((opcode >> 12) & 0x0F)
+    {
+    case 0x00:
+        if (NN == 0xE0)
+        {
+            // 0x00E0 clear screen
+            clear_screen();
+        }
+        else if (NN == 0xEE)
+        {
+            // 0x00EE: return from subroutine
+            pc = *--stack_ptr;
+        }
+        else if (Quirks::schip && (opcode & 0xFFF0) == 0x00C0)
+            // 0x00CN: scroll down N pixels
+            scroll_down(N);
+        else if (Quirks::xochip && (opcode & 0xFFF0) == 0x00D0)
+            // 0x00DN: scroll up N pixels (XO-CHIP)
+            scroll_up(N);
+        else if (Quirks::schip && opcode == 0x00FB)
+            // 0x00FB: scroll right 4 pixels
+            scroll_right();
+        else if (Quirks::schip && opcode == 0x00FC)
+            // 0x00FC: scroll left 4 pixels
+            scroll_left();
+        else if (Quirks::schip && opcode == 0x00FD)
+            // 0x00FD: exit the interpreter
+            exit_interpreter();
+        else if (Quirks::schip && (opcode == 0x00FE || opcode == 0x00FF))
+            // 0x00FE, 0x00FF: switch to lores or hires
+            set_resolution(opcode == 0x00FF);
+        break;
+
+    case 0x01:
+        // 1NNN jump to NNN
+        jump(NNN);
+        break;
+
+    case 0x02:
+        // 0x02NNN: call subroutine at NNN
+        *stack_ptr++ = pc;
+        pc = NNN;
+        break;
+
+    case 0x03:
+        // 0x3XNN: if VX == NN, skip next instruction;
+        if (registers[X] == NN)
+        {
+            skip<Quirks>();
+        }
+        break;
+
+    case 0x04:
+        // 0x4XNN: if VX != NN, skip next instruction
+        if (registers[X] != NN)
+        {
+            skip<Quirks>();
+        }
+        break;
+
+    case 0x05:
+        if (Quirks::xochip && N == 2)
+            // 0x5XY2: store VX to VY at I (XO-CHIP)
+            store_range(X, Y);
+        else if (Quirks::xochip && N == 3)
+            // 0x5XY3: load VX to VY from I (XO-CHIP)
+            load_range(X, Y);
+        else if (N == 0 && registers[X] == registers[Y])
+            // 0x5XY0: if VX == VY, skip next instruction
+            skip<Quirks>();
+        break;
+
+    case 0x06:
+        // 0x6XNN: set register vx to NN
+        registers[X] = NN;
+        break;
+
+    case 0x07:
+        // 0x07XNN:  set register vx += NN
+        registers[X] += NN;
+        break;
+
+    case 0x08:
+        switch (N)
+        {
+        case 0:
+            // 0x8XY0: set VX = VY
+            registers[X] = registers[Y];
+            break;
+
+        case 1:
+            // 0x0XY1: set register VX |= VY
+            registers[X] |= registers[Y];
+            if (Quirks::logic_resets_vf)
+                registers[0xF] = 0;
+            break;
+
+        case 2:
+            // 0x8XY2: set register VX &= VY
+            registers[X] &= registers[Y];
+            if (Quirks::logic_resets_vf)
+                registers[0xF] = 0;
+            break;
+
+        case 3:
+            // 0x8XY3: set register VX ^= VY
+            registers[X] ^= registers[Y];
+            if (Quirks::logic_resets_vf)
+                registers[0xF] = 0;
+            break;
+
+        case 4:
+            // 0x8XY4: set register VX += VY and set VF to 1 if overflow, else 0
+            {
+                bool carry = ((uint16_t)(registers[X] + registers[Y]) > 255);
+                registers[X] += registers[Y];
+                registers[0xF] = carry;
+                break;
+            }
+
+        case 5:
+            // 0x8XY5: set register VX-=VY, set VF to 0 when there's underflow, else 1
+            {
+                bool carry = (registers[X] >= registers[Y]);
+                registers[X] -= registers[Y];
+                registers[0xF] = carry;
+                break;
+            }
+
+        case 6:
+            // 0x8XY6: set VX >>= 1, store LSB of VX prior to shift in VF;
+            {
+                const uint8_t source = Quirks::shift_vx ? registers[X] : registers[Y];
+                bool carry = source & 1;
+                registers[X] = source >> 1;
+                registers[0xF] = carry;
+                break;
+            }
+
+        case 7:
+            // 0x8XY7: set VX = VY - VX, set VF to 0 if underflow, else 1
+            {
+                bool carry = registers[X] <= registers[Y];
+                registers[X] = registers[Y] - registers[X];
+                registers[0xF] = carry;
+                break;
+            }
+
+        case 0xE:
+            // 0x8XYE set register VX <<= 1, set VF to 1 if MSB of VX prior to shift was set, else 0
+            {
+                const uint8_t source = Quirks::shift_vx ? registers[X] : registers[Y];
+                bool carry = (source & 0x80) >> 7;
+                registers[X] = source << 1;
+                registers[0xF] = carry;
+                break;
+            }
+
+        default:
+            tracer.unknown(opcode);
+            break;
+        }
+        break;
+
+    case 0x09:
+        // 0x9XY0: if VX != VY skip next instruction
+        if (registers[X] != registers[Y])
+        {
+            skip<Quirks>();
+        }
+        break;
+
+    case 0x0A:
+        // 0xANNN: set index register I to NNN
+        index = NNN;
+        break;
+
+    case 0x0B:
+        // 0xBNNN: jump to V0 + NNN, or BXNN: jump to VX + XNN
+        pc = registers[Quirks::jump_vx ? X : 0] + NNN;
+        break;
+
+    case 0x0C:
+        // 0xCXNN: set VX = random%(256) & NN
+        registers[X] = random_byte() & NN;
+        break;
+
+    case 0x0D:
+        // 0xDXYN: draw N height sprite at (X,Y); Read from I;
+        draw_sprite<Quirks>(X, Y, N);
+        break;
+
+    case 0x0E:
+        if (NN == 0x9E)
+        {
+            // 0xEX9E if key in VX is pressed, skip next inst
+            if (keypad[registers[X] & 0xF])
+            {
+                skip<Quirks>();
+            }
+        }
+        else if (NN == 0xA1)
+        {
+            // 0xEX9E: if key in VX is not pressed, skip next inst;
+            if (!keypad[registers[X] & 0xF])
+            {
+                skip<Quirks>();
+            }
+        }
+        break;
+
+    case 0x0F:
+        switch (NN)
+        {
+        case 0x00:
+            // 0xF000 NNNN: set I to the 16-bit address in the next word (XO-CHIP)
+            if (Quirks::xochip && X == 0)
+                load_long_index();
+            break;
+
+        case 0x01:
+            // 0xFN01: select the planes in bit mask N (XO-CHIP)
+            if (Quirks::xochip)
+            {
+                planes = X & 3;
+                side_effects++;
+            }
+            break;
+
+        case 0x02:
+            // 0xF002: load the audio pattern from I (XO-CHIP)
+            if (Quirks::xochip && X == 0)
+                load_audio_pattern();
+            break;
+
+        case 0x0A:
+            // 0xFX0A: wait for a key press and release, store the key in VX
+            wait_for_key(X);
+            break;
+
+        case 0x1E:
+            // 0xFX1E: set I += VX
+            add_to_index<Quirks>(X);
+            break;
+
+        case 0x07:
+            // 0xFX07: VX = delay timer
+            // Need to implement delay timer
+            registers[X] = delay_timer;
+            break;
+
+        case 0x15:
+            // 0xFX15: delay timer = VX
+            // Need to implement delay timer
+            delay_timer = registers[X];
+            break;
+
+        case 0x18:
+            // 0xFX18: sound timer = VX
+            set_sound_timer(registers[X]);
+            break;
+
+        case 0x29:
+            // 0xFX29: Set I to the location of the sprite for the character in VX
+            index = registers[X] * 5;
+            break;
+
+        case 0x30:
+            // 0xFX30: set I to the big 8x10 digit in VX (SCHIP)
+            if (Quirks::schip)
+                index = BIG_FONT_ADDRESS + (registers[X] & 0xF) * 10;
+            break;
+
+        case 0x3A:
+            // 0xFX3A: set the audio pattern pitch to VX (XO-CHIP)
+            if (Quirks::xochip)
+            {
+                pitch = registers[X];
+                side_effects++;
+            }
+            break;
+
+        case 0x75:
+            // 0xFX75: save V0 to VX in the RPL user flags (SCHIP)
+            if (Quirks::schip)
+            {
+                memcpy(flags, registers, X + 1);
+                side_effects++;
+            }
+            break;
+
+        case 0x85:
+            // 0xFX85: load V0 to VX from the RPL user flags (SCHIP)
+            if (Quirks::schip)
+                memcpy(registers, flags, X + 1);
+            break;
+
+        case 0x33:
+            // 0xFX33: store BCD representaiton of VX, unit digit at I+2, tens digit at I+1, hundreds digit at I
+            store_bcd(X);
+            break;
+
+        case 0x55:
+            // 0xFX55: dump V0 to VX inclusive starting from I
+            store_registers<Quirks>(X);
+            break;
+
+        case 0x65:
+            // 0xFX65: load V0 to VX inclusive offset from I
+            load_registers<Quirks>(X);
+            break;
+
+        default:
+            tracer.unknown(opcode);
+            break;
+        }
+        break;
+
+    default:
+        tracer.unknown(opcode);
+        break;
+    }
+}
+
+void Chip8::set_core(Core new_core)
+{
+    core = new_core;
+
+    if (core == CORE_CACHED && decoded.empty())
+        decoded.assign(memory.size(), Instruction{});
+
+    if (core == CORE_BLOCK && blocks.empty())
+        flush_blocks();
+}
+
+// the profiler and debugger only hook into the interpreter, which the other cores match exactly, so a
+// profiled or debugged run goes through it whatever core is selected
+void Chip8::run(uint32_t instructions)
+{
+    const bool instrumented = profiler.enabled || debugger.armed;
+    // the profiler and debugger see every instruction, so an idle loop they ran into isn't skipped
+    idle_period = 0;
+
+    switch (profile)
+    {
+    case PROFILE_CHIP48:
+        run_core<QuirksCHIP48>(instructions, instrumented);
+        break;
+    case PROFILE_SCHIP:
+        run_core<QuirksSCHIP>(instructions, instrumented);
+        break;
+    case PROFILE_MODERN:
+        run_core<QuirksModern>(instructions, instrumented);
+        break;
+    case PROFILE_AMIGA:
+        run_core<QuirksAmiga>(instructions, instrumented);
+        break;
+    default:
+        run_core<QuirksVIP>(instructions, instrumented);
+        break;
+    }
+}
+
+template <typename Quirks>
+void Chip8::run_core(uint32_t instructions, bool instrumented)
+{
+    if (core == CORE_CACHED && !instrumented)
+        run_cached<Quirks>(instructions);
+    else if (core == CORE_BLOCK && !instrumented)
+        run_blocks<Quirks>(instructions);
+    else
+        run_interpreter<Quirks>(instructions);
+}
+
+template <typename Quirks>
+void Chip8::run_interpreter(uint32_t instructions)
+{
+    if (!profiler.enabled && !debugger.armed)
+    {
+        for (uint32_t i = 0; i < instructions; ++i)
+        {
+            execute_instruction<Quirks>();
+            if (idle_period)
+                i += skip_idle(instructions - i - 1);
+        }
+        return;
+    }
+
+    // profiling or debugging: look at each instruction before it runs, and at VF, pc or I after it to see
+    // collisions, calls and memory writes. a debugger stop ends the run early
+    for (uint32_t i = 0; i < instructions; ++i)
+    {
+        const uint16_t instruction = next_opcode();
+        const uint16_t first_written = index;
+        if (debugger.armed && break_before())
+            return;
+        if (profiler.enabled)
+            profiler.instruction(pc, instruction);
+
+        execute_instruction<Quirks>();
+
+        if (profiler.enabled)
+        {
+            if ((instruction & 0xF000) == 0x2000)
+                profiler.call(pc);
+            else if (instruction == 0x00EE)
+                profiler.ret();
+            else if ((instruction & 0xF000) == 0xD000)
+                profiler.draw(registers[0xF]);
+        }
+        if (debugger.armed && break_after(instruction, first_written))
+            return;
+    }
+}
+
+// the mnemonic for an instruction from the operands decode() extracted for the cores, in the usual
+// Cowgod style plus the SUPER-CHIP and XO-CHIP names Octo uses. anything else is shown as a data word.
+// operands follow the same quirks the core runs the instruction with
+template <typename Quirks>
+void disassemble(const Instruction &in, char *text, size_t size)
+{
+    static const char *const ALU[16] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", nullptr,
+                                        nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "SHL", nullptr};
+
+    switch (in.opcode >> 12)
+    {
+    case 0x0:
+        if (in.opcode == 0x00E0)
+            snprintf(text, size, "CLS");
+        else if (in.opcode == 0x00EE)
+            snprintf(text, size, "RET");
+        else if (Quirks::schip && (in.opcode & 0xFFF0) == 0x00C0)
+            snprintf(text, size, "SCD %u", in.N);
+        else if (Quirks::xochip && (in.opcode & 0xFFF0) == 0x00D0)
+            snprintf(text, size, "SCU %u", in.N);
+        else if (Quirks::schip && in.opcode == 0x00FB)
+            snprintf(text, size, "SCR");
+        else if (Quirks::schip && in.opcode == 0x00FC)
+            snprintf(text, size, "SCL");
+        else if (Quirks::schip && in.opcode == 0x00FD)
+            snprintf(text, size, "EXIT");
+        else if (Quirks::schip && in.opcode == 0x00FE)
+            snprintf(text, size, "LOW");
+        else if (Quirks::schip && in.opcode == 0x00FF)
+            snprintf(text, size, "HIGH");
+        else
+            snprintf(text, size, "SYS %03X", in.NNN);
+        return;
+    case 0x1:
+        snprintf(text, size, "JP %03X", in.NNN);
+        return;
+    case 0x2:
+        snprintf(text, size, "CALL %03X", in.NNN);
+        return;
+    case 0x3:
+        snprintf(text, size, "SE V%X, %02X", in.X, in.NN);
+        return;
+    case 0x4:
+        snprintf(text, size, "SNE V%X, %02X", in.X, in.NN);
+        return;
+    case 0x5:
+        if (in.N == 0)
+            snprintf(text, size, "SE V%X, V%X", in.X, in.Y);
+        else if (Quirks::xochip && in.N == 2)
+            snprintf(text, size, "SAVE V%X - V%X", in.X, in.Y);
+        else if (Quirks::xochip && in.N == 3)
+            snprintf(text, size, "LOAD V%X - V%X", in.X, in.Y);
+        else
+            break;
+        return;
+    case 0x6:
+        snprintf(text, size, "LD V%X, %02X", in.X, in.NN);
+        return;
+    case 0x7:
+        snprintf(text, size, "ADD V%X, %02X", in.X, in.NN);
+        return;
+    case 0x8:
+        if (in.N == 7)
+            snprintf(text, size, "SUBN V%X, V%X", in.X, in.Y);
+        else if (ALU[in.N])
+            snprintf(text, size, "%s V%X, V%X", ALU[in.N], in.X, in.Y);
+        else
+            break;
+        return;
+    case 0x9:
+        if (in.N != 0)
+            break;
+        snprintf(text, size, "SNE V%X, V%X", in.X, in.Y);
+        return;
+    case 0xA:
+        snprintf(text, size, "LD I, %03X", in.NNN);
+        return;
+    case 0xB:
+        snprintf(text, size, "JP V%X, %03X", in.X, in.NNN);
+        return;
+    case 0xC:
+        snprintf(text, size, "RND V%X, %02X", in.X, in.NN);
+        return;
+    case 0xD:
+        snprintf(text, size, "DRW V%X, V%X, %u", in.X, in.Y, in.N);
+        return;
+    case 0xE:
+        if (in.NN == 0x9E)
+            snprintf(text, size, "SKP V%X", in.X);
+        else if (in.NN == 0xA1)
+            snprintf(text, size, "SKNP V%X", in.X);
+        else
+            break;
+        return;
+    case 0xF:
+        // the extended FXNN instructions only exist with their instruction set
+        if ((!Quirks::xochip && (in.NN <= 0x02 || in.NN == 0x3A)) ||
+            (!Quirks::schip && (in.NN == 0x30 || in.NN == 0x75 || in.NN == 0x85)))
+            break;
+
+        switch (in.NN)
+        {
+        case 0x00:
+            if (in.X != 0)
+                break;
+            snprintf(text, size, "LD I, LONG");
+            return;
+        case 0x01:
+            snprintf(text, size, "PLANE %u", in.X);
+            return;
+        case 0x02:
+            if (in.X != 0)
+                break;
+            snprintf(text, size, "AUDIO");
+            return;
+        case 0x07:
+            snprintf(text, size, "LD V%X, DT", in.X);
+            return;
+        case 0x0A:
+            snprintf(text, size, "LD V%X, K", in.X);
+            return;
+        case 0x15:
+            snprintf(text, size, "LD DT, V%X", in.X);
+            return;
+        case 0x18:
+            snprintf(text, size, "LD ST, V%X", in.X);
+            return;
+        case 0x1E:
+            snprintf(text, size, "ADD I, V%X", in.X);
+            return;
+        case 0x29:
+            snprintf(text, size, "LD F, V%X", in.X);
+            return;
+        case 0x30:
+            snprintf(text, size, "LD HF, V%X", in.X);
+            return;
+        case 0x33:
+            snprintf(text, size, "LD B, V%X", in.X);
+            return;
+        case 0x3A:
+            snprintf(text, size, "PITCH V%X", in.X);
+            return;
+        case 0x55:
+            snprintf(text, size, "LD [I], V%X", in.X);
+            return;
+        case 0x65:
+            snprintf(text, size, "LD V%X, [I]", in.X);
+            return;
+        case 0x75:
+            snprintf(text, size, "LD R, V%X", in.X);
+            return;
+        case 0x85:
+            snprintf(text, size, "LD V%X, R", in.X);
+            return;
+        }
+        break;
+    }
+
+    snprintf(text, size, "DW %04X", in.opcode);
+}
+
+void disassemble(Profile profile, const Instruction &in, char *text, size_t size)
+{
+    switch (profile)
+    {
+    case PROFILE_CHIP48:
+        return disassemble<QuirksCHIP48>(in, text, size);
+    case PROFILE_SCHIP:
+        return disassemble<QuirksSCHIP>(in, text, size);
+    case PROFILE_MODERN:
+        return disassemble<QuirksModern>(in, text, size);
+    case PROFILE_AMIGA:
+        return disassemble<QuirksAmiga>(in, text, size);
+    default:
+        return disassemble<QuirksVIP>(in, text, size);
+    }
+}
+
+bool Chip8::evaluate_conditions() const
+{
+    for (const Condition &condition : debugger.conditions)
+    {
+        const uint16_t value = condition.reg == 16 ? index : registers[condition.reg];
+        if ((condition.op == '=' && value == condition.value) || (condition.op == '!' && value != condition.value) ||
+            (condition.op == '<' && value < condition.value) || (condition.op == '>' && value > condition.value))
+            return true;
+    }
+    return false;
+}
+
+// pauses the machine in front of the instruction at pc and ends any step in progress
+void Chip8::debug_stop(const char *reason)
+{
+    state = PAUSED;
+    debugger.steps = 0;
+    debugger.stepping_over = false;
+    debugger.update();
+
+    printf("%s\n", reason);
+    print_disassembly(pc, 1);
+    fflush(stdout);
+}
+
+bool Chip8::break_before()
+{
+    const bool skip = debugger.skip_breakpoint;
+    debugger.skip_breakpoint = false;
+
+    if (debugger.stepping_over && pc == debugger.return_address && stack_ptr - stack == debugger.return_depth)
+    {
+        debug_stop("stepped over");
+        return true;
+    }
+
+    if (!skip && Debugger::test(debugger.breakpoints, pc))
+    {
+        debug_stop("breakpoint");
+        return true;
+    }
+
+    return false;
+}
+
+// watchpoints fire on the instructions that store to memory: FX33, FX55 and 5XY2, starting at I as it was
+// before the instruction ran
+bool Chip8::break_after(uint16_t instruction, uint16_t first_written)
+{
+    const uint8_t X = (instruction >> 8) & 0xF;
+    const uint8_t Y = (instruction >> 4) & 0xF;
+    uint32_t length = 0;
+    if ((instruction & 0xF0FF) == 0xF033)
+        length = 3;
+    else if ((instruction & 0xF0FF) == 0xF055)
+        length = X + 1;
+    else if ((instruction & 0xF00F) == 0x5002)
+        length = (X < Y ? Y - X : X - Y) + 1;
+
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        const uint16_t address = first_written + i;
+        if (Debugger::test(debugger.watchpoints, address))
+        {
+            char reason[64];
+            snprintf(reason, sizeof reason, "watchpoint: %04X written", address);
+            debug_stop(reason);
+            return true;
+        }
+    }
+
+    if (!debugger.conditions.empty())
+    {
+        const bool met = evaluate_conditions();
+        const bool became_true = met && !debugger.conditions_met;
+        debugger.conditions_met = met;
+        if (became_true)
+        {
+            debug_stop("condition");
+            return true;
+        }
+    }
+
+    if (debugger.steps && --debugger.steps == 0)
+    {
+        debug_stop("step");
+        return true;
+    }
+
+    return false;
+}
+
+void Chip8::print_registers() const
+{
+    for (uint32_t i = 0; i < REGISTER_COUNT; ++i)
+        printf("V%X=%02X%s", i, registers[i], i % 8 == 7 ? "\n" : " ");
+    printf("I=%04X PC=%04X SP=%u DT=%02X ST=%02X", index, pc, (unsigned)(stack_ptr - stack), delay_timer, sound_timer);
+    for (const uint16_t *entry = stack; entry < stack_ptr; ++entry)
+        printf(entry == stack ? " stack %03X" : " %03X", *entry);
+    printf("\n");
+}
+
+void Chip8::print_disassembly(uint16_t address, uint32_t count) const
+{
+    char text[32];
+    for (uint32_t i = 0; i < count; ++i, address += 2)
+    {
+        const Instruction in = decode(address);
+        disassemble(profile, in, text, sizeof text);
+        printf("%s%04X  %04X  %s%s\n", address == pc ? "> " : "  ", address, in.opcode, text,
+               Debugger::test(debugger.breakpoints, address) ? "  *" : "");
+    }
+}
+
+// runs one debugger command line; returns false for one it doesn't know
+bool Chip8::debug_command(const char *line)
+{
+    char command[16] = "";
+    char arguments[3][16] = {"", "", ""};
+    const int fields = sscanf(line, "%15s %15s %15s %15s", command, arguments[0], arguments[1], arguments[2]);
+    if (fields < 1)
+        return true;
+
+    const uint32_t first = strtoul(arguments[0], nullptr, 16);
+    const uint32_t second = strtoul(arguments[1], nullptr, 16);
+
+    if (strcmp(command, "c") == 0)
+    {
+        state = RUNNING;
+        debugger.skip_breakpoint = debugger.armed;
+    }
+    else if (strcmp(command, "p") == 0)
+        debug_stop("paused");
+    else if (strcmp(command, "s") == 0)
+    {
+        debugger.steps = fields > 1 && first ? first : 1;
+        debugger.skip_breakpoint = true;
+        state = RUNNING;
+    }
+    else if (strcmp(command, "n") == 0)
+    {
+        // over a call, run until it returns here; anything else is a single step
+        if ((next_opcode() & 0xF000) == 0x2000)
+        {
+            debugger.stepping_over = true;
+            debugger.return_address = pc + 2;
+            debugger.return_depth = stack_ptr - stack;
+        }
+        else
+            debugger.steps = 1;
+        debugger.skip_breakpoint = true;
+        state = RUNNING;
+    }
+    else if ((strcmp(command, "b") == 0 || strcmp(command, "d") == 0) && fields > 1)
+        Debugger::set(debugger.breakpoints, first, command[0] == 'b');
+    else if ((strcmp(command, "w") == 0 || strcmp(command, "dw") == 0) && fields > 1)
+    {
+        for (uint32_t i = 0; i < (fields > 2 && second ? second : 1); ++i)
+            Debugger::set(debugger.watchpoints, first + i, command[0] == 'w');
+    }
+    else if (strcmp(command, "cond") == 0 && fields == 4)
+    {
+        Condition condition;
+        const char *name = arguments[0];
+        const char *op = arguments[1];
+        condition.value = strtoul(arguments[2], nullptr, 16);
+        if ((name[0] == 'I' || name[0] == 'i') && !name[1])
+            condition.reg = 16;
+        else if ((name[0] == 'V' || name[0] == 'v') && isxdigit(name[1]) && !name[2])
+            condition.reg = strtoul(name + 1, nullptr, 16);
+        else
+            return false;
+
+        if (strcmp(op, "==") == 0 || strcmp(op, "!=") == 0 || strcmp(op, "<") == 0 || strcmp(op, ">") == 0)
+            condition.op = op[0];
+        else
+            return false;
+
+        debugger.conditions.push_back(condition);
+        debugger.conditions_met = evaluate_conditions();
+    }
+    else if (strcmp(command, "clear") == 0)
+    {
+        debugger.breakpoints.clear();
+        debugger.watchpoints.clear();
+        debugger.conditions.clear();
+    }
+    else if (strcmp(command, "r") == 0)
+        print_registers();
+    else if (strcmp(command, "l") == 0)
+        print_disassembly(fields > 1 ? first : pc, fields > 2 && second ? second : 10);
+    else if (strcmp(command, "x") == 0 && fields > 1)
+    {
+        const uint32_t count = fields > 2 && second ? second : 16;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            if (i % 16 == 0)
+                printf("%s%04X ", i ? "\n" : "", (first + i) & 0xFFFF);
+            printf(" %02X", memory[(first + i) & memory_mask]);
+        }
+        printf("\n");
+    }
+    else if (strcmp(command, "q") == 0)
+        state = QUIT;
+    else if (strcmp(command, "h") == 0)
+        printf("c  continue            s [N]  step N instructions   n  step over a call   p  pause\n"
+               "b ADDR / d ADDR        set / delete a breakpoint\n"
+               "w ADDR [N] / dw ADDR [N]  watch / unwatch writes to N bytes\n"
+               "cond REG OP VALUE      stop when VX or I becomes ==, !=, < or > VALUE\n"
+               "clear                  remove all breakpoints, watchpoints and conditions\n"
+               "r  registers           l [ADDR] [N]  disassemble   x ADDR [N]  dump memory   q  quit\n"
+               "numbers are hexadecimal\n");
+    else
+        return false;
+
+    debugger.update();
+    return true;
+}
+
+void Chip8::set_profile(Profile new_profile)
+{
+    profile = new_profile;
+    resize_memory();
+
+    // the cached operations were decoded for the old quirks
+    if (!decoded.empty())
+        decoded.assign(memory.size(), Instruction{});
+
+    if (!blocks.empty())
+        flush_blocks();
+}
+
+// 4 KB like the original interpreters, 64 KB for XO-CHIP, doubled until an oversized rom fits. what
+// is already in memory stays, and a machine never needs more than that, so per-instance state stays small
+void Chip8::resize_memory()
+{
+    uint32_t size = PROFILE_MEMORY[profile];
+    while (size < rom_end)
+        size *= 2;
+
+    memory.resize(size);
+    memory_mask = size - 1;
+}
+
+// a write to memory[address] changes the instructions starting at address - 1 and address,
+// so the cached core decodes those entries again the next time it runs them. a write into
+// translated code throws away the blocks that cover it, they get translated again when they next run.
+// memory wraps at its end, so a write to memory[0] also changes the instruction at the last address
+void Chip8::invalidate(uint16_t address, uint32_t length)
+{
+    side_effects++;
+    const uint32_t size = memory.size();
+    address &= memory_mask;
+    const uint32_t first = address ? address - 1 : 0;
+    const uint32_t last = (uint32_t)address + length < size ? address + length : size;
+
+    if (address == 0 && !decoded.empty())
+        decoded[size - 1].operation = OP_DECODE;
+    if (address == 0 && !blocks.empty() && blocks[size - 1].translated)
+        drop_blocks(size - 1);
+    if ((uint32_t)address + length > size)
+        invalidate(0, address + length - size);
+
+    for (uint32_t i = first; !decoded.empty() && i < last; ++i)
+        decoded[i].operation = OP_DECODE;
+
+    for (uint32_t i = address; !blocks.empty() && i < last; ++i)
+    {
+        if (blocks[i].translated)
+            drop_blocks(i);
+    }
+}
+
+// a block covers at most 2 * MAX_BLOCK_LENGTH bytes, so only the blocks starting that close before
+// address can reach it. what they left in the code pools stays until a pool fills up
+void Chip8::drop_blocks(uint32_t address)
+{
+    const uint32_t first = address >= 2 * MAX_BLOCK_LENGTH ? address - 2 * MAX_BLOCK_LENGTH + 1 : 0;
+    for (uint32_t start = first; start <= address; ++start)
+    {
+        if (blocks[start].length && start + 2 * blocks[start].length > address)
+        {
+            blocks[start].length = 0;
+#ifdef CHIP8_JIT
+            native_blocks[start] = nullptr;
+#endif
+        }
+    }
+    blocks[address].translated = false;
+}
+
+Instruction Chip8::decode(uint16_t address) const
+{
+    switch (profile)
+    {
+    case PROFILE_CHIP48:
+        return decode<QuirksCHIP48>(address);
+    case PROFILE_SCHIP:
+        return decode<QuirksSCHIP>(address);
+    case PROFILE_MODERN:
+        return decode<QuirksModern>(address);
+    case PROFILE_AMIGA:
+        return decode<QuirksAmiga>(address);
+    default:
+        return decode<QuirksVIP>(address);
+    }
+}
+
+template <typename Quirks>
+Instruction Chip8::decode(uint16_t address) const
+{
+    Instruction in;
+    in.opcode = (memory[address & memory_mask] << 8) | memory[(address + 1) & memory_mask];
+    in.NNN = in.opcode & 0x0FFF;
+    in.NN = in.opcode & 0x0FF;
+    in.N = in.opcode & 0x0F;
+    in.X = (in.opcode >> 8) & 0x0F;
+    in.Y = (in.opcode >> 4) & 0x0F;
+    in.operation = OP_NONE;
+
+    switch ((in.opcode >> 12) & 0x0F)
+    {
+    case 0x00:
+        if (in.NN == 0xE0)
+            in.operation = OP_CLEAR;
+        else if (in.NN == 0xEE)
+            in.operation = OP_RETURN;
+        else if (Quirks::schip && (in.opcode & 0xFFF0) == 0x00C0)
+            in.operation = OP_SCROLL_DOWN;
+        else if (Quirks::xochip && (in.opcode & 0xFFF0) == 0x00D0)
+            in.operation = OP_SCROLL_UP;
+        else if (Quirks::schip && in.opcode == 0x00FB)
+            in.operation = OP_SCROLL_RIGHT;
+        else if (Quirks::schip && in.opcode == 0x00FC)
+            in.operation = OP_SCROLL_LEFT;
+        else if (Quirks::schip && in.opcode == 0x00FD)
+            in.operation = OP_EXIT;
+        else if (Quirks::schip && (in.opcode == 0x00FE || in.opcode == 0x00FF))
+        {
+            in.operation = OP_RESOLUTION;
+            in.N = in.opcode == 0x00FF;
+        }
+        break;
+
+    case 0x01:
+        in.operation = OP_JUMP;
+        break;
+
+    case 0x02:
+        in.operation = OP_CALL;
+        break;
+
+    case 0x03:
+        in.operation = OP_SKIP_EQUAL;
+        break;
+
+    case 0x04:
+        in.operation = OP_SKIP_NOT_EQUAL;
+        break;
+
+    case 0x05:
+        if (Quirks::xochip && in.N == 2)
+            in.operation = OP_STORE_RANGE;
+        else if (Quirks::xochip && in.N == 3)
+            in.operation = OP_LOAD_RANGE;
+        else if (in.N == 0)
+            in.operation = OP_SKIP_EQUAL_VY;
+        break;
+
+    case 0x06:
+        in.operation = OP_LOAD;
+        break;
+
+    case 0x07:
+        in.operation = OP_ADD;
+        break;
+
+    case 0x08:
+    {
+        static const Operation ALU[16] = {OP_MOVE,    OP_OR,      OP_AND,     OP_XOR,        OP_ADD_VY,  OP_SUB,
+                                          OP_SHIFT_RIGHT, OP_SUBN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN,
+                                          OP_UNKNOWN, OP_UNKNOWN, OP_SHIFT_LEFT, OP_UNKNOWN};
+        in.operation = ALU[in.N];
+        // the shift quirk picks the source register once, here: Y is what gets shifted
+        if (Quirks::shift_vx && (in.operation == OP_SHIFT_RIGHT || in.operation == OP_SHIFT_LEFT))
+            in.Y = in.X;
+        break;
+    }
+
+    case 0x09:
+        in.operation = OP_SKIP_NOT_EQUAL_VY;
+        break;
+
+    case 0x0A:
+        in.operation = OP_LOAD_INDEX;
+        break;
+
+    case 0x0B:
+        // X is the register added to NNN, V0 unless the jump quirk says VX
+        in.operation = OP_JUMP_OFFSET;
+        in.X = Quirks::jump_vx ? in.X : 0;
+        break;
+
+    case 0x0C:
+        in.operation = OP_RANDOM;
+        break;
+
+    case 0x0D:
+        in.operation = OP_DRAW;
+        break;
+
+    case 0x0E:
+        if (in.NN == 0x9E)
+            in.operation = OP_SKIP_KEY;
+        else if (in.NN == 0xA1)
+            in.operation = OP_SKIP_NOT_KEY;
+        break;
+
+    case 0x0F:
+        switch (in.NN)
+        {
+        case 0x00:
+            if (Quirks::xochip && in.X == 0)
+                in.operation = OP_LOAD_LONG_INDEX;
+            break;
+
+        case 0x01:
+            if (Quirks::xochip)
+                in.operation = OP_PLANES;
+            break;
+
+        case 0x02:
+            if (Quirks::xochip && in.X == 0)
+                in.operation = OP_AUDIO_PATTERN;
+            break;
+
+        case 0x0A:
+            in.operation = OP_WAIT_KEY;
+            break;
+
+        case 0x1E:
+            in.operation = OP_ADD_INDEX;
+            break;
+
+        case 0x07:
+            in.operation = OP_GET_DELAY;
+            break;
+
+        case 0x15:
+            in.operation = OP_SET_DELAY;
+            break;
+
+        case 0x18:
+            in.operation = OP_SET_SOUND;
+            break;
+
+        case 0x29:
+            in.operation = OP_FONT;
+            break;
+
+        case 0x30:
+            if (Quirks::schip)
+                in.operation = OP_BIG_FONT;
+            break;
+
+        case 0x3A:
+            if (Quirks::xochip)
+                in.operation = OP_PITCH;
+            break;
+
+        case 0x75:
+            if (Quirks::schip)
+                in.operation = OP_SAVE_FLAGS;
+            break;
+
+        case 0x85:
+            if (Quirks::schip)
+                in.operation = OP_LOAD_FLAGS;
+            break;
+
+        case 0x33:
+            in.operation = OP_BCD;
+            break;
+
+        case 0x55:
+            in.operation = OP_STORE_REGISTERS;
+            break;
+
+        case 0x65:
+            in.operation = OP_LOAD_REGISTERS;
+            break;
+
+        default:
+            in.operation = OP_UNKNOWN;
+            break;
+        }
+        break;
+    }
+
+    return in;
+}
+
+// runs a decoded instruction with pc already advanced past it, like execute_instruction. a flat switch
+// on the operation the decoder picked, with the quirks already folded into its operands, so there is no
+// second decode
+template <typename Quirks>
+__attribute__((always_inline)) inline void Chip8::execute_decoded(Instruction in)
+{
+    switch (in.operation)
+    {
+    case OP_NONE:
+        break;
+
+    case OP_UNKNOWN:
+        tracer.unknown(in.opcode);
+        break;
+
+    case OP_CLEAR:
+        clear_screen();
+        break;
+
+    case OP_RETURN:
+        pc = *--stack_ptr;
+        break;
+
+    case OP_SCROLL_DOWN:
+        scroll_down(in.N);
+        break;
+
+    case OP_SCROLL_UP:
+        scroll_up(in.N);
+        break;
+
+    case OP_SCROLL_RIGHT:
+        scroll_right();
+        break;
+
+    case OP_SCROLL_LEFT:
+        scroll_left();
+        break;
+
+    case OP_EXIT:
+        exit_interpreter();
+        break;
+
+    case OP_RESOLUTION:
+        set_resolution(in.N);
+        break;
+
+    case OP_JUMP:
+        jump(in.NNN);
+        break;
+
+    case OP_CALL:
+        *stack_ptr++ = pc;
+        pc = in.NNN;
+        break;
+
+    case OP_SKIP_EQUAL:
+        if (registers[in.X] == in.NN)
+            skip<Quirks>();
+        break;
+
+    case OP_SKIP_NOT_EQUAL:
+        if (registers[in.X] != in.NN)
+            skip<Quirks>();
+        break;
+
+    case OP_STORE_RANGE:
+        store_range(in.X, in.Y);
+        break;
+
+    case OP_LOAD_RANGE:
+        load_range(in.X, in.Y);
+        break;
+
+    case OP_SKIP_EQUAL_VY:
+        if (registers[in.X] == registers[in.Y])
+            skip<Quirks>();
+        break;
+
+    case OP_LOAD:
+        registers[in.X] = in.NN;
+        break;
+
+    case OP_ADD:
+        registers[in.X] += in.NN;
+        break;
+
+    case OP_MOVE:
+        registers[in.X] = registers[in.Y];
+        break;
+
+    case OP_OR:
+        registers[in.X] |= registers[in.Y];
+        if (Quirks::logic_resets_vf)
+            registers[0xF] = 0;
+        break;
+
+    case OP_AND:
+        registers[in.X] &= registers[in.Y];
+        if (Quirks::logic_resets_vf)
+            registers[0xF] = 0;
+        break;
+
+    case OP_XOR:
+        registers[in.X] ^= registers[in.Y];
+        if (Quirks::logic_resets_vf)
+            registers[0xF] = 0;
+        break;
+
+    case OP_ADD_VY:
+    {
+        bool carry = ((uint16_t)(registers[in.X] + registers[in.Y]) > 255);
+        registers[in.X] += registers[in.Y];
+        registers[0xF] = carry;
+        break;
+    }
+
+    case OP_SUB:
+    {
+        bool carry = (registers[in.X] >= registers[in.Y]);
+        registers[in.X] -= registers[in.Y];
+        registers[0xF] = carry;
+        break;
+    }
+
+    case OP_SHIFT_RIGHT:
+    {
+        const uint8_t source = registers[in.Y];
+        bool carry = source & 1;
+        registers[in.X] = source >> 1;
+        registers[0xF] = carry;
+        break;
+    }
+
+    case OP_SUBN:
+    {
+        bool carry = registers[in.X] <= registers[in.Y];
+        registers[in.X] = registers[in.Y] - registers[in.X];
+        registers[0xF] = carry;
+        break;
+    }
+
+    case OP_SHIFT_LEFT:
+    {
+        const uint8_t source = registers[in.Y];
+        bool carry = (source & 0x80) >> 7;
+        registers[in.X] = source << 1;
+        registers[0xF] = carry;
+        break;
+    }
+
+    case OP_SKIP_NOT_EQUAL_VY:
+        if (registers[in.X] != registers[in.Y])
+            skip<Quirks>();
+        break;
+
+    case OP_LOAD_INDEX:
+        index = in.NNN;
+        break;
+
+    case OP_JUMP_OFFSET:
+        pc = registers[in.X] + in.NNN;
+        break;
+
+    case OP_RANDOM:
+        registers[in.X] = random_byte() & in.NN;
+        break;
+
+    case OP_DRAW:
+        draw_sprite<Quirks>(in.X, in.Y, in.N);
+        break;
+
+    case OP_SKIP_KEY:
+        if (keypad[registers[in.X] & 0xF])
+            skip<Quirks>();
+        break;
+
+    case OP_SKIP_NOT_KEY:
+        if (!keypad[registers[in.X] & 0xF])
+            skip<Quirks>();
+        break;
+
+    case OP_LOAD_LONG_INDEX:
+        load_long_index();
+        break;
+
+    case OP_PLANES:
+        planes = in.X & 3;
+        side_effects++;
+        break;
+
+    case OP_AUDIO_PATTERN:
+        load_audio_pattern();
+        break;
+
+    case OP_WAIT_KEY:
+        wait_for_key(in.X);
+        break;
+
+    case OP_ADD_INDEX:
+        add_to_index<Quirks>(in.X);
+        break;
+
+    case OP_GET_DELAY:
+        registers[in.X] = delay_timer;
+        break;
+
+    case OP_SET_DELAY:
+        delay_timer = registers[in.X];
+        break;
+
+    case OP_SET_SOUND:
+        set_sound_timer(registers[in.X]);
+        break;
+
+    case OP_FONT:
+        index = registers[in.X] * 5;
+        break;
+
+    case OP_BIG_FONT:
+        index = BIG_FONT_ADDRESS + (registers[in.X] & 0xF) * 10;
+        break;
+
+    case OP_PITCH:
+        pitch = registers[in.X];
+        side_effects++;
+        break;
+
+    case OP_SAVE_FLAGS:
+        memcpy(flags, registers, in.X + 1);
+        side_effects++;
+        break;
+
+    case OP_LOAD_FLAGS:
+        memcpy(registers, flags, in.X + 1);
+        break;
+
+    case OP_BCD:
+        store_bcd(in.X);
+        break;
+
+    case OP_STORE_REGISTERS:
+        store_registers<Quirks>(in.X);
+        break;
+
+    case OP_LOAD_REGISTERS:
+        load_registers<Quirks>(in.X);
+        break;
+    }
+}
+
+// execute_decoded with the operation known at compile time, so it compiles down to that one case
+template <typename Quirks, uint8_t OPERATION>
+void Chip8::execute_operation(Chip8 &chip8, const Instruction &in)
+{
+    Instruction fixed = in;
+    fixed.operation = OPERATION;
+    chip8.execute_decoded<Quirks>(fixed);
+}
+
+// one execute_operation per operation, indexed by it
+template <typename Quirks, size_t... OPERATIONS>
+const Handler *Chip8::handlers(std::index_sequence<OPERATIONS...>)
+{
+    static const Handler table[] = {&execute_operation<Quirks, OPERATIONS>...};
+    return table;
+}
+
+// one whole step of the cached core for an operation known at compile time: advance pc and cycles, then
+// run it. OP_DECODE decodes the entry at pc in place and steps through what it became, so an entry that
+// needs decoding costs no check on the way to one that doesn't
+template <typename Quirks, uint8_t OPERATION>
+void Chip8::step_operation(Chip8 &chip8, const Instruction &in)
+{
+    if (OPERATION == OP_DECODE)
+    {
+        const uint16_t address = chip8.pc & chip8.memory_mask;
+        Instruction &entry = chip8.decoded[address];
+        entry = chip8.decode<Quirks>(address);
+        step_handlers<Quirks>(std::make_index_sequence<OP_COUNT>())[entry.operation](chip8, entry);
+        return;
+    }
+
+    chip8.tracer.record(chip8.pc, in.opcode, chip8.index, chip8.registers);
+    chip8.pc += 2;
+    chip8.cycles++;
+    execute_operation<Quirks, OPERATION>(chip8, in);
+}
+
+template <typename Quirks, size_t... OPERATIONS>
+const Handler *Chip8::step_handlers(std::index_sequence<OPERATIONS...>)
+{
+    static const Handler table[] = {&step_operation<Quirks, OPERATIONS>...};
+    return table;
+}
+
+// every step is one call through the table of the profile's step handlers, indexed by the entry's
+// operation, so the loop itself holds no switch and no decode check
+template <typename Quirks>
+void Chip8::run_cached(uint32_t instructions)
+{
+    const Handler *step = step_handlers<Quirks>(std::make_index_sequence<OP_COUNT>());
+
+    for (uint32_t i = 0; i < instructions; ++i)
+    {
+        const Instruction &instruction = decoded[pc & memory_mask];
+        step[instruction.operation](*this, instruction);
+        if (idle_period)
+            i += skip_idle(instructions - i - 1);
+    }
+}
+
+// instructions after which the next one can't be assumed to follow in memory: jumps, calls, returns,
+// skips, the FX0A wait, 00FD, the F000 long load and stores that might rewrite code.
+// FX18 also ends a block since it reads cycles
+bool ends_block(const Instruction &in)
+{
+    switch ((in.opcode >> 12) & 0x0F)
+    {
+    case 0x00:
+        return in.NN == 0xEE || in.opcode == 0x00FD;
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x05:
+    case 0x09:
+    case 0x0B:
+    case 0x0E:
+        return true;
+    case 0x0F:
+        return in.opcode == 0xF000 || in.NN == 0x0A || in.NN == 0x18 || in.NN == 0x33 || in.NN == 0x55;
+    default:
+        return false;
+    }
+}
+
+// the code pool is bounded: when it is full every block goes and translation starts over
+template <typename Quirks>
+Block &Chip8::translate(uint16_t address)
+{
+    if (code.size() + MAX_BLOCK_LENGTH > CODE_POOL_INSTRUCTIONS)
+        flush_blocks();
+
+    Block &block = blocks[address];
+    block.offset = code.size();
+    block.length = 0;
+    block.runs = 0;
+
+    for (uint32_t pos = address; pos < memory.size() && block.length < MAX_BLOCK_LENGTH; pos += 2)
+    {
+        const Instruction in = decode<Quirks>(pos);
+        code.push_back(in);
+        block.length++;
+
+        blocks[pos].translated = true;
+        if (pos + 1 < memory.size())
+            blocks[pos + 1].translated = true;
+
+        if (ends_block(in))
+            break;
+    }
+
+    return block;
+}
+
+#ifdef CHIP8_JIT
+// a native block runs whole or not at all. on entry it checks the budget covers it, and if not leaves
+// to run_blocks with pc still on it. it advances pc and cycles once, like the threaded loop, then runs
+// its instructions: the simple register, I and timer operations and the skips inline, the rest as a
+// call to the operation's handler with a record of the instruction that sits just before the block.
+// at the end it leaves if an idle loop was found, otherwise it looks pc up in native_blocks and jumps
+// straight into the next block, leaving only when that one isn't compiled yet
+template <typename Quirks>
+void Chip8::compile_block(uint16_t address, const Block &block)
+{
+    // the native pool is bounded too: when it is full the native code goes, the translated blocks stay
+    if (native.used + MAX_NATIVE_BLOCK > NATIVE_POOL_SIZE)
+    {
+        native_blocks.assign(native_blocks.size(), nullptr);
+        native.reset();
+    }
+    if (!native.writable(true))
+        return;
+
+    Emitter out{native.base + native.used};
+    if (!native.stubs)
+    {
+        // entry: push rbx, r12 and rbp (keeping the stack aligned for calls), machine to rbx, budget
+        // to r12d, jump to the block
+        out.bytes({0x53, 0x41, 0x54, 0x55, 0x48, 0x89, 0xFB, 0x41, 0x89, 0xF4, 0xFF, 0xE2});
+        // exit: budget left to eax, restore and return
+        out.bytes({0x44, 0x89, 0xE0, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+        native.stubs = out.at - native.base;
+    }
+    const uint8_t *exit = native.base + 12;
+
+    const Instruction *in = &code[block.offset];
+    const uint8_t *records = out.at;
+    memcpy(out.at, in, block.length * sizeof(Instruction));
+    out.at += block.length * sizeof(Instruction);
+
+    const uint8_t *entry = out.at;
+    // cmp r12d, length; jb exit; sub r12d, length
+    out.bytes({0x41, 0x83, 0xFC, (uint8_t)block.length, 0x0F, 0x82});
+    out.rel32(exit);
+    out.bytes({0x41, 0x83, 0xEC, (uint8_t)block.length});
+    // add word [pc], 2 * length; add qword [cycles], length
+    out.bytes({0x66, 0x81});
+    out.field(0, field(&pc));
+    out.value((uint16_t)(2 * block.length));
+    out.bytes({0x48, 0x83});
+    out.field(0, field(&cycles));
+    out.bytes({(uint8_t)block.length});
+
+    for (uint32_t i = 0; i < block.length; ++i)
+        compile_instruction<Quirks>(out, in[i], address + 2 * i, records + i * sizeof(Instruction));
+
+    // cmp qword [idle_period], 0; jne exit
+    out.bytes({0x48, 0x83});
+    out.field(7, field(&idle_period));
+    out.bytes({0x00, 0x0F, 0x85});
+    out.rel32(exit);
+    // movzx eax, word [pc]; and eax, memory_mask; mov rcx, native_blocks; mov rax, [rcx + rax * 8]
+    out.bytes({0x0F, 0xB7});
+    out.field(0, field(&pc));
+    out.bytes({0x25});
+    out.value((uint32_t)memory_mask);
+    out.bytes({0x48, 0xB9});
+    out.value(native_blocks.data());
+    out.bytes({0x48, 0x8B, 0x04, 0xC1});
+    // test rax, rax; je exit; jmp rax
+    out.bytes({0x48, 0x85, 0xC0, 0x0F, 0x84});
+    out.rel32(exit);
+    out.bytes({0xFF, 0xE0});
+
+    native.used = out.at - native.base;
+    if (native.writable(false))
+        native_blocks[address] = entry;
+}
+
+template <typename Quirks>
+void Chip8::compile_instruction(Emitter &out, const Instruction &in, uint16_t address, const uint8_t *record)
+{
+    const int32_t VX = field(&registers[in.X]);
+    const int32_t VY = field(&registers[in.Y]);
+    const int32_t VF = field(&registers[0xF]);
+
+    switch (in.operation)
+    {
+    case OP_LOAD:
+        // mov byte [VX], NN
+        out.bytes({0xC6});
+        out.field(0, VX);
+        out.bytes({in.NN});
+        return;
+
+    case OP_ADD:
+        // add byte [VX], NN
+        out.bytes({0x80});
+        out.field(0, VX);
+        out.bytes({in.NN});
+        return;
+
+    case OP_MOVE:
+        // mov al, [VY]; mov [VX], al
+        out.bytes({0x8A});
+        out.field(0, VY);
+        out.bytes({0x88});
+        out.field(0, VX);
+        return;
+
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+        // mov al, [VY]; or/and/xor [VX], al; then mov byte [VF], 0 if logic resets VF
+        out.bytes({0x8A});
+        out.field(0, VY);
+        out.bytes({(uint8_t)(in.operation == OP_OR ? 0x08 : in.operation == OP_AND ? 0x20 : 0x30)});
+        out.field(0, VX);
+        if (Quirks::logic_resets_vf)
+        {
+            out.bytes({0xC6});
+            out.field(0, VF);
+            out.bytes({0x00});
+        }
+        return;
+
+    case OP_ADD_VY:
+        // mov al, [VY]; add [VX], al; setc [VF]
+        out.bytes({0x8A});
+        out.field(0, VY);
+        out.bytes({0x00});
+        out.field(0, VX);
+        out.bytes({0x0F, 0x92});
+        out.field(0, VF);
+        return;
+
+    case OP_SUB:
+    case OP_SUBN:
+    {
+        // mov al, [minuend]; sub al, [subtrahend]; setnc cl; mov [VX], al; mov [VF], cl
+        const bool reverse = in.operation == OP_SUBN;
+        out.bytes({0x8A});
+        out.field(0, reverse ? VY : VX);
+        out.bytes({0x2A});
+        out.field(0, reverse ? VX : VY);
+        out.bytes({0x0F, 0x93, 0xC1, 0x88});
+        out.field(0, VX);
+        out.bytes({0x88});
+        out.field(1, VF);
+        return;
+    }
+
+    case OP_SHIFT_RIGHT:
+    case OP_SHIFT_LEFT:
+        // mov al, [VY]; mov cl, al; then and cl, 1; shr al, 1 or shr cl, 7; add al, al; then mov [VX], al;
+        // mov [VF], cl. decode already put the shift source in Y
+        out.bytes({0x8A});
+        out.field(0, VY);
+        out.bytes({0x88, 0xC1});
+        if (in.operation == OP_SHIFT_RIGHT)
+            out.bytes({0x80, 0xE1, 0x01, 0xD0, 0xE8});
+        else
+            out.bytes({0xC0, 0xE9, 0x07, 0x00, 0xC0});
+        out.bytes({0x88});
+        out.field(0, VX);
+        out.bytes({0x88});
+        out.field(1, VF);
+        return;
+
+    case OP_LOAD_INDEX:
+        // mov word [index], NNN
+        out.bytes({0x66, 0xC7});
+        out.field(0, field(&index));
+        out.value(in.NNN);
+        return;
+
+    case OP_GET_DELAY:
+        // mov al, [delay_timer]; mov [VX], al
+        out.bytes({0x8A});
+        out.field(0, field(&delay_timer));
+        out.bytes({0x88});
+        out.field(0, VX);
+        return;
+
+    case OP_SET_DELAY:
+        // mov al, [VX]; mov [delay_timer], al
+        out.bytes({0x8A});
+        out.field(0, VX);
+        out.bytes({0x88});
+        out.field(0, field(&delay_timer));
+        return;
+
+    case OP_FONT:
+        // movzx eax, byte [VX]; lea eax, [rax + rax * 4]; mov [index], ax
+        out.bytes({0x0F, 0xB6});
+        out.field(0, VX);
+        out.bytes({0x8D, 0x04, 0x80, 0x66, 0x89});
+        out.field(0, field(&index));
+        return;
+
+    case OP_SKIP_EQUAL:
+    case OP_SKIP_NOT_EQUAL:
+    case OP_SKIP_EQUAL_VY:
+    case OP_SKIP_NOT_EQUAL_VY:
+        // XO-CHIP skips look at the next opcode for F000, so they go through the handler
+        if (Quirks::xochip)
+            break;
+        if (in.operation == OP_SKIP_EQUAL || in.operation == OP_SKIP_NOT_EQUAL)
+        {
+            // cmp byte [VX], NN
+            out.bytes({0x80});
+            out.field(7, VX);
+            out.bytes({in.NN});
+        }
+        else
+        {
+            // mov al, [VY]; cmp [VX], al
+            out.bytes({0x8A});
+            out.field(0, VY);
+            out.bytes({0x38});
+            out.field(0, VX);
+        }
+        // jne or je over the add word [pc], 2 that follows
+        out.bytes({(uint8_t)(in.operation == OP_SKIP_EQUAL || in.operation == OP_SKIP_EQUAL_VY ? 0x75 : 0x74), 8, 0x66, 0x83});
+        out.field(0, field(&pc));
+        out.bytes({2});
+        return;
+
+    case OP_JUMP:
+        // only a backward jump can close an idle loop, so a forward one is just mov word [pc], NNN
+        if (in.NNN < address + 2)
+            break;
+        out.bytes({0x66, 0xC7});
+        out.field(0, field(&pc));
+        out.value(in.NNN);
+        return;
+    }
+
+    // mov rdi, rbx; lea rsi, [rip + record]; mov rax, handler; call rax
+    out.bytes({0x48, 0x89, 0xDF, 0x48, 0x8D, 0x35});
+    out.rel32(record);
+    out.bytes({0x48, 0xB8});
+    out.value(handlers<Quirks>(std::make_index_sequence<OP_COUNT>())[in.operation]);
+    out.bytes({0xFF, 0xD0});
+}
+#endif
+
+void Chip8::flush_blocks()
+{
+    blocks.assign(memory.size(), Block{});
+    code.clear();
+#ifdef CHIP8_JIT
+    native_blocks.assign(memory.size(), nullptr);
+    native.reset();
+#endif
+}
+
+// only the last instruction of a block reads pc or cycles, so both are advanced once per block and every
+// instruction before it runs with the value it would have had after the last instruction.
+// compiled blocks run natively while the budget covers them, chaining from one to the next. the rest,
+// and the tail of a run that would stop in the middle of a block, go one call per instruction through
+// the handler of its operation, as threaded code, and a block that ran that way often enough is compiled
+template <typename Quirks>
+void Chip8::run_blocks(uint32_t instructions)
+{
+    const Handler *handler = handlers<Quirks>(std::make_index_sequence<OP_COUNT>());
+
+    while (instructions)
+    {
+        const uint16_t address = pc & memory_mask;
+        Block &block = blocks[address].length ? blocks[address] : translate<Quirks>(address);
+
+#ifdef CHIP8_JIT
+        if (!native_blocks[address] && block.runs < COMPILE_AFTER_RUNS && ++block.runs == COMPILE_AFTER_RUNS)
+            compile_block<Quirks>(address, block);
+        if (native_blocks[address] && block.length <= instructions)
+        {
+            instructions = ((NativeEntry)native.base)(this, instructions, native_blocks[address]);
+            if (idle_period)
+                instructions -= skip_idle(instructions);
+            continue;
+        }
+#endif
+
+        const uint32_t count = block.length < instructions ? block.length : instructions;
+        const Instruction *in = &code[block.offset];
+        const uint16_t start = pc;
+
+        instructions -= count;
+        pc += 2 * count;
+        cycles += count;
+
+        for (uint32_t i = 0; i < count; ++i, ++in)
+        {
+            opcode = in->opcode;
+            tracer.record(start + 2 * i, opcode, index, registers);
+            handler[in->operation](*this, *in);
+        }
+
+        // only a block's last instruction can close an idle loop
+        if (idle_period)
+            instructions -= skip_idle(instructions);
+    }
+}
+
+// rom hash to quirk profile, read from a text file of "hash profile title" lines
+typedef std::vector<std::pair<uint32_t, Profile>> ProfileDatabase;
+
+const char *const DEFAULT_PROFILE_DATABASE = "roms/profiles.txt";
+const char *const DEFAULT_KEYMAP_FILE = "roms/keymaps.txt";
+
+// a default file is named relative to the repository; it is looked for in the working directory, next to
+// the executable (where make puts it), then beside the rom. returns the path that exists, or false
+bool find_default_file(const char *relative, const char *rom_file_name, std::string &path)
+{
+    std::vector<std::string> candidates{relative};
+    if (char *base = SDL_GetBasePath())
+    {
+        candidates.push_back(std::string(base) + relative);
+        SDL_free(base);
+    }
+    if (rom_file_name)
+    {
+        const char *slash = strrchr(rom_file_name, '/');
+        const char *name = strrchr(relative, '/');
+        candidates.push_back(std::string(rom_file_name, slash ? slash + 1 - rom_file_name : 0) + (name ? name + 1 : relative));
+    }
+
+    for (const std::string &candidate : candidates)
+    {
+        if (FILE *file = fopen(candidate.c_str(), "r"))
+        {
+            fclose(file);
+            path = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct Options
+{
+    bool headless = false;
+    bool uncapped = false;
+    uint64_t frame_limit = 0;
+    uint64_t instruction_limit = 0;
+    const char *trace_file_name = nullptr;
+    const char *stats_file_name = nullptr;
+    const char *folded_file_name = nullptr;
+    bool debug = false;
+    const char *batch_file_name = nullptr;
+    bool fade_benchmark = false;
+    bool snapshot_benchmark = false;
+    const char *load_state_file_name = nullptr;
+    const char *save_state_file_name = nullptr;
+    size_t rewind_budget = 16 << 20;
+    uint64_t rewind_frames = 0;
+    uint32_t seed = 0;
+    bool seed_given = false;
+    const char *record_file_name = nullptr;
+    const char *replay_file_name = nullptr;
+    const char *golden_file_name = nullptr;
+    bool bless = false;
+    uint16_t audio_buffer_samples = AUDIO_BUFFER_SAMPLES;
+    uint32_t clock_rate = CLOCK_RATE;
+    bool clock_given = false;
+    unsigned int threads = 0;
+    Core core = CORE_INTERPRETER;
+    // PROFILE_COUNT: look the rom up in the profile database
+    Profile profile = PROFILE_COUNT;
+    const char *profile_database_file_name = nullptr;
+    ProfileDatabase profile_database;
+    const char *keymap_file_name = nullptr;
+    const char *capture_name = nullptr;
+    char *rom_file_name = nullptr;
+};
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] <rom_file_name>\n", program);
+    fprintf(stderr, "  --headless          run without a window or audio device\n");
+    fprintf(stderr, "  --uncapped          run as fast as possible instead of in real time\n");
+    fprintf(stderr, "  --clock HZ          instructions per second (default %u)\n", CLOCK_RATE);
+    fprintf(stderr, "  --frames N          stop after N frames (headless only)\n");
+    fprintf(stderr, "  --instructions N    stop after N instructions (headless only)\n");
+    fprintf(stderr, "  --core NAME         interpreter core: interpreter (default), cached or block\n");
+    fprintf(stderr, "  --quirks NAME       quirk profile: vip, chip48, schip, modern or amiga (default: by rom)\n");
+    fprintf(stderr, "  --profiles FILE     rom hash to quirk profile database (default %s, looked for\n"
+                    "                      in the working directory, next to the executable, then beside the rom)\n",
+            DEFAULT_PROFILE_DATABASE);
+    fprintf(stderr, "  --keymap FILE       keyboard and game controller bindings by rom hash (default %s, looked\n"
+                    "                      for like the profile database)\n",
+            DEFAULT_KEYMAP_FILE);
+    fprintf(stderr, "  --batch FILE        run every job in FILE headless on a thread pool, no rom argument\n");
+    fprintf(stderr, "  --threads N         worker threads for --batch and --golden (default: one per core)\n");
+    fprintf(stderr, "  --golden FILE       check every core against the frame hashes in FILE, no rom argument\n");
+    fprintf(stderr, "  --bless             with --golden, write the current results back to FILE\n");
+    fprintf(stderr, "  --audio-buffer N    audio device buffer in samples (default %u)\n", AUDIO_BUFFER_SAMPLES);
+    fprintf(stderr, "  --bench-fade        compare the fade kernels against lerp(), no rom argument\n");
+    fprintf(stderr, "  --bench-snapshot    time save and restore of the rom's state\n");
+    fprintf(stderr, "  --load-state FILE   start from the snapshot in FILE instead of power-on\n");
+    fprintf(stderr, "  --save-state FILE   write a snapshot to FILE when a headless run ends\n");
+    fprintf(stderr, "  --rewind-budget MB  memory for rewind history, 0 turns it off (default 16)\n");
+    fprintf(stderr, "  --rewind N          step back N frames before a headless run ends (headless only)\n");
+    fprintf(stderr, "  --seed N            seed for CXNN (default: 0 headless, the clock in a window)\n");
+    fprintf(stderr, "  --record FILE       write the seed and keypad input of a window session to FILE\n");
+    fprintf(stderr, "  --replay FILE       play back a recorded movie from FILE (headless only)\n");
+    fprintf(stderr, "  --capture NAME      record the emulated frames to NAME.y4m and their audio to NAME.wav\n");
+    fprintf(stderr, "  --trace FILE        write binary trace records to FILE (needs make TRACE=1)\n");
+    fprintf(stderr, "  --debug             start paused with a debugger prompt on stdin (h lists commands)\n");
+    fprintf(stderr, "  --stats FILE        profile from the start, write counts and frame times to FILE (.json or .csv)\n");
+    fprintf(stderr, "  --folded FILE       profile from the start, write the call stacks in folded format to FILE\n");
+}
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+            options.headless = true;
+        else if (strcmp(argv[i], "--uncapped") == 0)
+            options.uncapped = true;
+        else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+        {
+            options.clock_rate = strtoul(argv[++i], nullptr, 10);
+            options.clock_given = true;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            options.frame_limit = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc)
+            options.instruction_limit = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc)
+        {
+            if (!core_from_name(argv[++i], options.core))
+                return false;
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            if (!profile_from_name(argv[++i], options.profile))
+                return false;
+        }
+        else if (strcmp(argv[i], "--profiles") == 0 && i + 1 < argc)
+            options.profile_database_file_name = argv[++i];
+        else if (strcmp(argv[i], "--keymap") == 0 && i + 1 < argc)
+            options.keymap_file_name = argv[++i];
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+            options.capture_name = argv[++i];
+        else if (strcmp(argv[i], "--debug") == 0)
+            options.debug = true;
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            options.stats_file_name = argv[++i];
+        else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc)
+            options.folded_file_name = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            options.trace_file_name = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            options.batch_file_name = argv[++i];
+        else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc)
+            options.audio_buffer_samples = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc)
+            options.golden_file_name = argv[++i];
+        else if (strcmp(argv[i], "--bless") == 0)
+            options.bless = true;
+        else if (strcmp(argv[i], "--bench-fade") == 0)
+            options.fade_benchmark = true;
+        else if (strcmp(argv[i], "--bench-snapshot") == 0)
+            options.snapshot_benchmark = true;
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+            options.load_state_file_name = argv[++i];
+        else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc)
+            options.save_state_file_name = argv[++i];
+        else if (strcmp(argv[i], "--rewind-budget") == 0 && i + 1 < argc)
+            options.rewind_budget = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc)
+            options.rewind_frames = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            options.seed = strtoul(argv[++i], nullptr, 10);
+            options.seed_given = true;
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            options.record_file_name = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            options.replay_file_name = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            options.threads = strtoul(argv[++i], nullptr, 10);
+        else if (argv[i][0] == '-' || options.rom_file_name)
+            return false;
+        else
+            options.rom_file_name = argv[i];
+    }
+
+    // a headless run with no budget would never report anything
+    if (options.headless && !options.frame_limit && !options.instruction_limit)
+        options.frame_limit = 10 * FPS;
+
+    // movies are played back without SDL input, recorded with it
+    if (options.replay_file_name && !options.headless)
+        return false;
+
+    if (options.bless && !options.golden_file_name)
+        return false;
+
+    if (options.batch_file_name || options.golden_file_name || options.fade_benchmark)
+        return options.rom_file_name == nullptr;
+
+    return options.rom_file_name != nullptr;
+}
+
+// reads "<fnv-1a of the rom in hex> <profile>" lines
+bool load_profile_database(const char *file_name, ProfileDatabase &database)
+{
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open profile database %s\n", file_name);
+        return false;
+    }
+
+    char line[1024];
+    unsigned int line_number = 0;
+    while (fgets(line, sizeof line, file))
+    {
+        line_number++;
+        if (char *comment = strchr(line, '#'))
+            *comment = '\0';
+
+        unsigned int hash;
+        char name[32];
+        const int fields = sscanf(line, "%x %31s", &hash, name);
+        if (fields <= 0)
+            continue;
+
+        uint32_t profile = 0;
+        while (fields == 2 && profile < PROFILE_COUNT && strcmp(name, PROFILE_NAMES[profile]) != 0)
+            profile++;
+
+        if (fields != 2 || profile == PROFILE_COUNT)
+        {
+            fprintf(stderr, "%s:%u: expected a rom hash and a quirk profile\n", file_name, line_number);
+            fclose(file);
+            return false;
+        }
+
+        database.push_back({hash, (Profile)profile});
+    }
+
+    fclose(file);
+    return true;
+}
+
+// keymap file: "<rom hash or *> <keypad key> <input>...", '#' starts a comment. an input is an SDL scancode
+// name with _ for spaces (W, Up, Keypad_8) or pad: and an SDL controller button name (pad:a, pad:dpup).
+// lines for * and for rom_hash bind their inputs on top of the defaults, in file order
+bool load_keymap(const char *file_name, uint32_t rom_hash, Keymap &keymap)
+{
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open keymap %s\n", file_name);
+        return false;
+    }
+
+    char line[1024];
+    unsigned int line_number = 0;
+    while (fgets(line, sizeof line, file))
+    {
+        line_number++;
+        if (char *comment = strchr(line, '#'))
+            *comment = '\0';
+
+        const char *rom = strtok(line, " \t\r\n");
+        if (!rom)
+            continue;
+
+        const char *key_name = strtok(nullptr, " \t\r\n");
+        char *end;
+        const unsigned long key = key_name ? strtoul(key_name, &end, 16) : KEY_COUNT;
+        const bool any = strcmp(rom, "*") == 0;
+        unsigned int hash = 0;
+        if (key >= KEY_COUNT || *end || (!any && sscanf(rom, "%x", &hash) != 1))
+        {
+            fprintf(stderr, "%s:%u: expected a rom hash, a keypad key and inputs\n", file_name, line_number);
+            fclose(file);
+            return false;
+        }
+
+        while (char *input = strtok(nullptr, " \t\r\n"))
+        {
+            for (char *c = input; *c; ++c)
+            {
+                if (*c == '_')
+                    *c = ' ';
+            }
+
+            bool known;
+            if (strncmp(input, "pad:", 4) == 0)
+            {
+                const SDL_GameControllerButton button = SDL_GameControllerGetButtonFromString(input + 4);
+                known = button != SDL_CONTROLLER_BUTTON_INVALID;
+                if (known && (any || hash == rom_hash))
+                    keymap.buttons[button] = key;
+            }
+            else
+            {
+                const SDL_Scancode scancode = SDL_GetScancodeFromName(input);
+                known = scancode != SDL_SCANCODE_UNKNOWN;
+                if (known && (any || hash == rom_hash))
+                    keymap.keys[scancode] = key;
+            }
+
+            if (!known)
+            {
+                fprintf(stderr, "%s:%u: unknown input %s\n", file_name, line_number, input);
+                fclose(file);
+                return false;
+            }
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// the database entry for the rom, or the original COSMAC VIP behavior
+Profile database_profile(const ProfileDatabase &database, uint32_t rom_hash)
+{
+    for (const auto &entry : database)
+    {
+        if (entry.first == rom_hash)
+            return entry.second;
+    }
+
+    return PROFILE_VIP;
+}
+
+// --quirks wins, then the database
+Profile choose_profile(const Options &options, uint32_t rom_hash)
+{
+    if (options.profile != PROFILE_COUNT)
+        return options.profile;
+
+    return database_profile(options.profile_database, rom_hash);
+}
+
+// runs the instructions of frame, switching the keypad at the offsets of the events of inputs that fall
+// into it. next is the first event not applied yet. the machine only sees key changes between runs, which
+// keeps the idle loop fast-forward exact
+void run_frame(Chip8 &chip8, uint32_t instructions, const InputLog &inputs, size_t &next, uint64_t frame)
+{
+    uint32_t done = 0;
+    while (next < inputs.size() && inputs[next].frame <= frame)
+    {
+        const InputEvent &input = inputs[next++];
+        const uint32_t offset = input.frame < frame ? 0 : std::min(input.offset, instructions);
+        if (offset > done && chip8.state == RUNNING)
+        {
+            chip8.run(offset - done);
+            done = offset;
+        }
+        chip8.set_keypad(input.mask);
+    }
+
+    if (instructions > done && chip8.state == RUNNING)
+        chip8.run(instructions - done);
+}
+
+// appends a keypad change if it differs from the last one recorded
+void record_input(InputLog &inputs, const InputEvent &input)
+{
+    if (inputs.empty() ? input.mask != 0 : inputs.back().mask != input.mask)
+        inputs.push_back(input);
+}
 
-            default:
+bool read_movie(const char *file_name, Movie &movie)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file)
+        return false;
+
+    uint32_t magic = 0, count = 0;
+    uint16_t version = 0, profile = 0;
+    movie.clock_rate = 0;
+    bool ok = fread(&magic, 4, 1, file) == 1 && fread(&version, 2, 1, file) == 1 && fread(&profile, 2, 1, file) == 1 &&
+              fread(&movie.seed, 4, 1, file) == 1 && (version < 3 || fread(&movie.clock_rate, 4, 1, file) == 1) &&
+              fread(&count, 4, 1, file) == 1 && magic == MOVIE_MAGIC && version >= 1 && version <= MOVIE_VERSION &&
+              (version < 3 ? profile == 0 : profile < PROFILE_COUNT && movie.clock_rate > 0);
+    movie.profile = version < 3 ? PROFILE_COUNT : (Profile)profile;
+
+    movie.inputs.clear();
+    for (uint32_t i = 0; ok && i < count; ++i)
+    {
+        uint32_t frame, offset = 0;
+        uint16_t mask;
+        ok = fread(&frame, 4, 1, file) == 1 && (version == 1 || fread(&offset, 4, 1, file) == 1) && fread(&mask, 2, 1, file) == 1 &&
+             (movie.inputs.empty() || frame > movie.inputs.back().frame ||
+              (frame == movie.inputs.back().frame && offset >= movie.inputs.back().offset));
+        movie.inputs.push_back({frame, offset, mask});
+    }
+
+    fclose(file);
+    return ok;
+}
+
+bool write_movie(const char *file_name, const Movie &movie)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file)
+        return false;
+
+    const uint32_t count = movie.inputs.size();
+    const uint16_t profile = movie.profile;
+    bool ok = fwrite(&MOVIE_MAGIC, 4, 1, file) == 1 && fwrite(&MOVIE_VERSION, 2, 1, file) == 1 &&
+              fwrite(&profile, 2, 1, file) == 1 && fwrite(&movie.seed, 4, 1, file) == 1 &&
+              fwrite(&movie.clock_rate, 4, 1, file) == 1 && fwrite(&count, 4, 1, file) == 1;
+
+    for (const auto &input : movie.inputs)
+    {
+        const uint32_t frame = input.frame;
+        ok = ok && fwrite(&frame, 4, 1, file) == 1 && fwrite(&input.offset, 4, 1, file) == 1 && fwrite(&input.mask, 2, 1, file) == 1;
+    }
+
+    return fclose(file) == 0 && ok;
+}
+
+// the debugger prompt, one command per line on stdin. headless it returns as soon as a command sets the
+// machine running again; next to a window it keeps reading on its own thread and takes the emulation lock
+// for every command
+void run_debug_console(Chip8 &chip8, EmulationLock *shared)
+{
+    char line[256];
+    for (;;)
+    {
+        if (!shared && chip8.state != PAUSED)
+            return;
+
+        printf("(chip8) ");
+        fflush(stdout);
+        if (!fgets(line, sizeof line, stdin))
+            break;
+
+        std::unique_lock<std::mutex> lock;
+        if (shared)
+            lock = std::unique_lock<std::mutex>(shared->mutex);
+        if (!chip8.debug_command(line))
+            printf("unknown command, h lists them\n");
+        if (shared)
+            shared->wake();
+        if (chip8.state == QUIT)
+            break;
+    }
+
+    // end of input or q: quit, and wake the window's event loop so it notices
+    if (shared)
+    {
+        SDL_Event e{};
+        e.type = SDL_QUIT;
+        SDL_PushEvent(&e);
+    }
+    else
+        chip8.state = QUIT;
+}
+
+// runs the core without SDL video/audio and reports throughput on stderr
+void run_headless(Chip8 &chip8, const Options &options, const InputLog &inputs, CaptureWriter *capture)
+{
+    const double frequency = (double)SDL_GetPerformanceFrequency();
+
+    FrameClock clock(options.clock_rate);
+    FrameScheduler scheduler;
+
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+    size_t next_input = 0;
+
+    fprintf(stderr, "%s: rom %08x, %s quirks\n", options.rom_file_name, chip8.rom_identity(), PROFILE_NAMES[chip8.quirk_profile()]);
+
+    // history is only kept when the run is asked to step back at the end
+    RewindBuffer rewind(options.rewind_frames ? options.rewind_budget : 0);
+    Snapshot snapshot;
+    if (options.rewind_frames)
+    {
+        chip8.save_state(snapshot);
+        rewind.push(snapshot);
+    }
+
+    const uint64_t start_time = SDL_GetPerformanceCounter();
+    CpuMeter cpu;
+    // what the capture is handed, if there is one
+    Frame frame{};
+
+    while (chip8.state != QUIT)
+    {
+        if (chip8.state == PAUSED)
+        {
+            run_debug_console(chip8, nullptr);
+            continue;
+        }
+
+        if (options.frame_limit && frames >= options.frame_limit)
+            break;
+
+        uint64_t batch = clock.next_frame();
+        if (options.instruction_limit)
+        {
+            if (instructions >= options.instruction_limit)
                 break;
+            if (options.instruction_limit - instructions < batch)
+                batch = options.instruction_limit - instructions;
+        }
+
+        // the clock is only read while profiling, a headless frame can be shorter than the call
+        const bool profiling = chip8.profiler.enabled;
+        uint64_t start = profiling ? SDL_GetPerformanceCounter() : 0;
+        run_frame(chip8, batch, inputs, next_input, frames);
+        instructions += batch;
+        if (profiling)
+            chip8.profiler.emulation.add(SDL_GetPerformanceCounter() - start);
+
+        if (!options.uncapped)
+            scheduler.wait_for_next_frame();
+
+        start = profiling ? SDL_GetPerformanceCounter() : 0;
+        if (capture)
+        {
+            int16_t samples[SAMPLES_PER_FRAME];
+            chip8.update_timers(samples);
+            chip8.publish(frame);
+            capture->push(frame, samples, true);
+        }
+        else
+            chip8.tick_timers();
+        frames++;
+        if (profiling)
+            chip8.profiler.timers.add(SDL_GetPerformanceCounter() - start);
+
+        if (options.rewind_frames)
+        {
+            chip8.save_state(snapshot);
+            rewind.push(snapshot);
+        }
+    }
+
+    const double elapsed = (SDL_GetPerformanceCounter() - start_time) / frequency;
+    cpu.sample();
+
+    // instructions skipped as idle loops cost nothing, so the rates only count the ones that ran
+    const uint64_t skipped = chip8.idle_instructions();
+    const uint64_t executed = instructions - skipped;
+    fprintf(stderr, "%s: %llu instructions (%llu executed, %llu skipped idle), %llu frames in %.3f s | %.2f MIPS, "
+                    "%.2f ns/instruction, %.0f frames/s, %.1f%% idle, %.1f%% cpu\n",
+            options.rom_file_name, (unsigned long long)instructions, (unsigned long long)executed,
+            (unsigned long long)skipped, (unsigned long long)frames, elapsed,
+            elapsed > 0 ? executed / elapsed / 1e6 : 0.0,
+            executed ? elapsed * 1e9 / executed : 0.0,
+            elapsed > 0 ? frames / elapsed : 0.0,
+            instructions ? 100.0 * skipped / instructions : 0.0,
+            100 * cpu.average());
+
+    uint64_t stepped = 0;
+    while (stepped < options.rewind_frames && rewind.step_back(snapshot))
+        stepped++;
+
+    if (stepped)
+    {
+        chip8.load_state(snapshot);
+        fprintf(stderr, "%s: rewound %llu frames\n", options.rom_file_name, (unsigned long long)stepped);
+    }
+}
+
+// one headless run of a batch: a rom, an instruction budget and the keypad state to apply at given frames
+struct Job
+{
+    std::string rom_file_name;
+    uint64_t instruction_budget;
+    InputLog inputs;
+};
+
+struct JobResult
+{
+    bool loaded = false;
+    uint64_t instructions = 0;
+    // of those, the ones fast-forwarded as idle loops
+    uint64_t skipped = 0;
+    uint64_t frames = 0;
+    uint32_t display_hash = 0;
+};
+
+// job file: one job per line, "<rom> <instructions> [<frame>:<hex keypad mask>]...", '#' starts a comment
+bool load_jobs(const char *file_name, std::vector<Job> &jobs)
+{
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open job file %s\n", file_name);
+        return false;
+    }
+
+    char line[4096];
+    unsigned int line_number = 0;
+    while (fgets(line, sizeof line, file))
+    {
+        line_number++;
+        if (char *comment = strchr(line, '#'))
+            *comment = '\0';
+
+        char *token = strtok(line, " \t\r\n");
+        if (!token)
+            continue;
+
+        Job job;
+        job.rom_file_name = token;
+
+        token = strtok(nullptr, " \t\r\n");
+        if (!token || !(job.instruction_budget = strtoull(token, nullptr, 10)))
+        {
+            fprintf(stderr, "%s:%u: expected an instruction budget\n", file_name, line_number);
+            fclose(file);
+            return false;
+        }
+
+        while ((token = strtok(nullptr, " \t\r\n")))
+        {
+            unsigned long long frame;
+            unsigned int mask;
+            if (sscanf(token, "%llu:%x", &frame, &mask) != 2 || (!job.inputs.empty() && frame < job.inputs.back().frame))
+            {
+                fprintf(stderr, "%s:%u: bad input event '%s'\n", file_name, line_number, token);
+                fclose(file);
+                return false;
+            }
+            job.inputs.push_back({frame, 0, (uint16_t)mask});
+        }
+
+        jobs.push_back(job);
+    }
+
+    fclose(file);
+    return true;
+}
+
+JobResult run_job(const Job &job, const Options &options)
+{
+    JobResult result;
+
+    Chip8 chip8(job.rom_file_name.c_str(), options.seed);
+    if (chip8.state != RUNNING)
+        return result;
+
+    chip8.set_core(options.core);
+    chip8.set_profile(choose_profile(options, chip8.rom_identity()));
+    result.loaded = true;
+
+    FrameClock clock(options.clock_rate);
+    size_t next_input = 0;
+
+    while (chip8.state != QUIT && result.instructions < job.instruction_budget)
+    {
+        uint64_t batch = clock.next_frame();
+        if (batch > job.instruction_budget - result.instructions)
+            batch = job.instruction_budget - result.instructions;
+
+        run_frame(chip8, batch, job.inputs, next_input, result.frames);
+        chip8.tick_timers();
+
+        result.instructions += batch;
+        result.frames++;
+    }
+
+    result.skipped = chip8.idle_instructions();
+    result.display_hash = chip8.display_hash();
+    return result;
+}
+
+// per-worker job queue: the owner takes from the back, idle workers steal from the front
+class WorkQueue
+{
+private:
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+
+public:
+    void push(size_t job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job);
+    }
+
+    bool pop(size_t &job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty())
+            return false;
+        job = jobs.back();
+        jobs.pop_back();
+        return true;
+    }
+
+    bool steal(size_t &job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty())
+            return false;
+        job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+};
+
+// worker self of a work-stealing pool: runs its own queue, then steals from the others.
+// no work item queues more, so a worker that finds every queue empty is done
+template <typename Work>
+void drain_queues(std::vector<WorkQueue> &queues, unsigned int self, const Work &work)
+{
+    const size_t thread_count = queues.size();
+    size_t job;
+    for (;;)
+    {
+        bool found = queues[self].pop(job);
+        for (size_t i = 1; !found && i < thread_count; ++i)
+            found = queues[(self + i) % thread_count].steal(job);
+
+        if (!found)
+            return;
+
+        work(job);
+    }
+}
+
+// calls work(i) for every i below count on a work-stealing pool of thread_count threads
+template <typename Work>
+void run_parallel(size_t count, unsigned int thread_count, Work work)
+{
+    std::vector<WorkQueue> queues(thread_count);
+    for (size_t i = 0; i < count; ++i)
+        queues[i % thread_count].push(i);
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < thread_count; ++i)
+        threads.emplace_back([&, i] { drain_queues(queues, i, work); });
+    drain_queues(queues, 0, work);
+
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+// run_parallel for callers that come back many times a second: the threads stay up between runs and sleep
+// on a condition variable. the calling thread is worker 0, and one run happens at a time
+class WorkerPool
+{
+private:
+    std::vector<WorkQueue> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(size_t)> *work = nullptr;
+    uint64_t generation = 0;
+    size_t busy = 0;
+    bool stopping = false;
+
+    void serve(unsigned int self)
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            const std::function<void(size_t)> *job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                job = work;
             }
+
+            drain_queues(queues, self, *job);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0)
+                finished.notify_one();
+        }
+    }
+
+public:
+    explicit WorkerPool(unsigned int thread_count) : queues(std::max(1u, thread_count))
+    {
+        for (unsigned int i = 1; i < queues.size(); ++i)
+            threads.emplace_back(&WorkerPool::serve, this, i);
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    // every worker takes part in every run, so none can still be draining when the next one queues work
+    void run(size_t count, const std::function<void(size_t)> &job)
+    {
+        if (threads.empty() || count < 2)
+        {
+            for (size_t i = 0; i < count; ++i)
+                job(i);
+            return;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            queues[i % queues.size()].push(i);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            work = &job;
+            busy = threads.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        drain_queues(queues, 0, job);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return busy == 0; });
+        work = nullptr;
+    }
+};
+
+// runs every job on its own Chip8 instance
+void run_batch(const std::vector<Job> &jobs, std::vector<JobResult> &results, const Options &options, unsigned int thread_count)
+{
+    results.assign(jobs.size(), JobResult{});
+    run_parallel(jobs.size(), thread_count,
+                 [&](size_t job) { results[job] = run_job(jobs[job], options); });
+}
+
+unsigned int worker_threads(const Options &options)
+{
+    const unsigned int thread_count = options.threads ? options.threads : std::thread::hardware_concurrency();
+    return thread_count ? thread_count : 1;
+}
+
+int run_batch_file(const Options &options)
+{
+    std::vector<Job> jobs;
+    if (!load_jobs(options.batch_file_name, jobs))
+        return EXIT_FAILURE;
+
+    const unsigned int thread_count = worker_threads(options);
+
+    std::vector<JobResult> results;
+
+    const double frequency = (double)SDL_GetPerformanceFrequency();
+    const uint64_t start_time = SDL_GetPerformanceCounter();
+
+    run_batch(jobs, results, options, thread_count);
+
+    const double elapsed = (SDL_GetPerformanceCounter() - start_time) / frequency;
+
+    uint64_t executed = 0;
+    int status = 0;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (!results[i].loaded)
+        {
+            printf("%s: could not load rom\n", jobs[i].rom_file_name.c_str());
+            status = EXIT_FAILURE;
+            continue;
         }
+
+        printf("%s: %llu instructions, %llu frames, display %08x\n", jobs[i].rom_file_name.c_str(),
+               (unsigned long long)results[i].instructions, (unsigned long long)results[i].frames, results[i].display_hash);
+        executed += results[i].instructions - results[i].skipped;
+    }
+
+    fprintf(stderr, "%zu jobs on %u threads in %.3f s | %.2f MIPS executed, %.0f jobs/s\n", jobs.size(), thread_count, elapsed,
+            elapsed > 0 ? executed / elapsed / 1e6 : 0.0, elapsed > 0 ? jobs.size() / elapsed : 0.0);
+
+    return status;
+}
+
+void Profiler::start()
+{
+    if (nodes.empty())
+    {
+        nodes.push_back(CallNode{0, 0, 0, 0});
+        pc_executions.assign(MEMORY_SIZE, 0);
+    }
+    enabled = true;
+}
+
+// calls nested deeper than the stack holds are charged to the deepest subroutine until they return
+void Profiler::call(uint16_t address)
+{
+    if (nodes[current].depth == STACK_SIZE)
+    {
+        overflow++;
+        return;
+    }
+
+    const uint64_t key = (uint64_t)current << 16 | address;
+    auto child = children.find(key);
+    if (child == children.end())
+    {
+        child = children.emplace(key, (uint32_t)nodes.size()).first;
+        nodes.push_back(CallNode{current, address, (uint8_t)(nodes[current].depth + 1), 0});
     }
+    current = child->second;
 }
 
-// lerp-helper function
-uint32_t lerp(uint32_t initial, uint32_t final, float t)
+void Profiler::ret()
 {
-    // extract and handle RGBa separately
-    uint8_t r_initial = (initial >> 24) & 0xFF;
-    uint8_t g_initial = (initial >> 16) & 0xFF;
-    uint8_t b_initial = (initial >> 8) & 0xFF;
-    uint8_t a_initial = (initial >> 0) & 0xFF;
+    if (overflow)
+        overflow--;
+    else
+        current = nodes[current].parent;
+}
 
-    uint8_t r_final = (final >> 24) & 0xFF;
-    uint8_t g_final = (final >> 16) & 0xFF;
-    uint8_t b_final = (final >> 8) & 0xFF;
-    uint8_t a_final = (final >> 0) & 0xFF;
+// one line per call path that executed anything: main;sub_2A4;sub_312 count, as flamegraph.pl expects
+bool Profiler::write_folded(const char *file_name) const
+{
+    FILE *file = fopen(file_name, "w");
+    if (!file)
+        return false;
 
-    // use the "precise" method to generate a middle color
-    uint8_t r = (1 - t) * r_initial + (t * r_final);
-    uint8_t g = (1 - t) * g_initial + (t * g_final);
-    uint8_t b = (1 - t) * b_initial + (t * b_final);
-    uint8_t a = (1 - t) * a_initial + (t * a_final);
+    std::vector<uint16_t> path;
+    for (const CallNode &node : nodes)
+    {
+        if (!node.instructions)
+            continue;
 
-    uint32_t res = (r << 24) | (g << 16) | (b << 8) | (a << 0);
-    return res;
+        path.clear();
+        for (const CallNode *n = &node; n->depth; n = &nodes[n->parent])
+            path.push_back(n->address);
+
+        fprintf(file, "main");
+        for (auto address = path.rbegin(); address != path.rend(); ++address)
+            fprintf(file, ";sub_%03X", *address);
+        fprintf(file, " %llu\n", (unsigned long long)node.instructions);
+    }
+
+    return fclose(file) == 0;
 }
 
-void Chip8::update_screen(SDL_Renderer **renderer)
+// totals, collisions, frame times in microseconds, then executions per opcode group and per pc (hottest
+// first), as JSON or, for a file name ending in .csv, as section,name,value rows
+bool Profiler::write_report(const char *file_name, const char *rom_file_name) const
 {
-    SDL_Rect rect;
-    rect.x = 0, rect.y = 0, rect.w = SCALE_FACTOR, rect.h = SCALE_FACTOR;
+    FILE *file = fopen(file_name, "w");
+    if (!file)
+        return false;
+
+    const size_t length = strlen(file_name);
+    const bool csv = length >= 4 && strcmp(file_name + length - 4, ".csv") == 0;
+    const double microseconds = 1e6 / SDL_GetPerformanceFrequency();
+
+    uint64_t instructions = 0;
+    for (uint32_t group = 0; group < 16; ++group)
+        instructions += executions[group];
 
-    for (uint32_t i = 0; i < sizeof display; ++i)
+    std::vector<uint16_t> hot;
+    for (uint32_t address = 0; address < pc_executions.size(); ++address)
+        if (pc_executions[address])
+            hot.push_back(address);
+    std::stable_sort(hot.begin(), hot.end(), [this](uint16_t a, uint16_t b) { return pc_executions[a] > pc_executions[b]; });
+
+    const struct
     {
-        rect.x = (i % (WINDOW_WIDTH)) * SCALE_FACTOR;
-        rect.y = (i / (WINDOW_WIDTH)) * SCALE_FACTOR;
+        const char *name;
+        const FrameTime &time;
+    } times[] = {{"emulation", emulation}, {"timers", timers}, {"render", render}};
 
-        if (display[i])
+    if (csv)
+    {
+        fprintf(file, "section,name,value\n");
+        fprintf(file, "total,instructions,%llu\n", (unsigned long long)instructions);
+        fprintf(file, "total,draws,%llu\n", (unsigned long long)draws);
+        fprintf(file, "total,collisions,%llu\n", (unsigned long long)collisions);
+        for (const auto &entry : times)
         {
-            // pixel is on, lerp towards white (which should be drawn)
-            uint32_t white = 0xFFFFFFFF;
+            fprintf(file, "time_us,%s_frames,%llu\n", entry.name, (unsigned long long)entry.time.frames);
+            fprintf(file, "time_us,%s_mean,%.3f\n", entry.name, entry.time.frames ? entry.time.total * microseconds / entry.time.frames : 0.0);
+            fprintf(file, "time_us,%s_max,%.3f\n", entry.name, entry.time.max * microseconds);
+        }
+        for (uint32_t group = 0; group < 16; ++group)
+            fprintf(file, "group,%s,%llu\n", OPCODE_GROUPS[group], (unsigned long long)executions[group]);
+        for (uint16_t address : hot)
+            fprintf(file, "pc,0x%04X,%llu\n", address, (unsigned long long)pc_executions[address]);
+        return fclose(file) == 0;
+    }
 
-            if (pixel_color[i] != white)
-                pixel_color[i] = lerp(pixel_color[i], white, lerp_rate);
+    fprintf(file, "{\n  \"rom\": \"");
+    for (const char *c = rom_file_name; *c; ++c)
+        fprintf(file, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    fprintf(file, "\",\n");
+    fprintf(file, "  \"instructions\": %llu,\n", (unsigned long long)instructions);
+    fprintf(file, "  \"draws\": %llu,\n", (unsigned long long)draws);
+    fprintf(file, "  \"collisions\": %llu,\n", (unsigned long long)collisions);
+    fprintf(file, "  \"collision_rate\": %.4f,\n", draws ? (double)collisions / draws : 0.0);
+    fprintf(file, "  \"time_us\": {\n");
+    for (uint32_t i = 0; i < 3; ++i)
+        fprintf(file, "    \"%s\": {\"frames\": %llu, \"mean\": %.3f, \"max\": %.3f}%s\n", times[i].name,
+                (unsigned long long)times[i].time.frames,
+                times[i].time.frames ? times[i].time.total * microseconds / times[i].time.frames : 0.0,
+                times[i].time.max * microseconds, i < 2 ? "," : "");
+    fprintf(file, "  },\n  \"opcode_groups\": {");
+    for (uint32_t group = 0; group < 16; ++group)
+        fprintf(file, "%s\"%s\": %llu", group ? ", " : "", OPCODE_GROUPS[group], (unsigned long long)executions[group]);
+    fprintf(file, "},\n  \"pc\": {");
+    for (size_t i = 0; i < hot.size(); ++i)
+        fprintf(file, "%s\"0x%04X\": %llu", i ? ", " : "", hot[i], (unsigned long long)pc_executions[hot[i]]);
+    fprintf(file, "}\n}\n");
+
+    return fclose(file) == 0;
+}
+
+// machine state at one frame of a golden run: hashes of the framebuffer, of the cpu (registers, I, pc, stack
+// and timers) and of memory, plus how often each opcode group ran to get there
+struct Checkpoint
+{
+    std::string rom_file_name;
+    // PROFILE_COUNT to pick it from the profile database, as a plain run would
+    Profile profile = PROFILE_COUNT;
+    uint64_t frame = 0;
+    // keypad changes at frame starts, from power-on
+    InputLog inputs;
+    bool measured = false;
+    uint32_t display_hash = 0;
+    uint32_t cpu_hash = 0;
+    uint32_t memory_hash = 0;
+    uint64_t executions[16]{};
+};
 
-            uint8_t r = (pixel_color[i] >> 24) & 0xFF;
-            uint8_t g = (pixel_color[i] >> 16) & 0xFF;
-            uint8_t b = (pixel_color[i] >> 8) & 0xFF;
-            uint8_t a = (pixel_color[i] >> 0) & 0xFF;
+// one line per checkpoint: rom, optionally a quirk profile, optionally keypad changes as frame:mask (hex),
+// frame, then display, cpu and memory hashes and the executions per opcode group 0-F; a line with only a rom
+// and a frame is a new checkpoint that --bless fills in
+bool load_golden(const char *file_name, std::vector<Checkpoint> &checkpoints)
+{
+    FILE *file = fopen(file_name, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Could not open golden file %s\n", file_name);
+        return false;
+    }
 
-            SDL_SetRenderDrawColor(*renderer, r, g, b, a);
-            SDL_RenderFillRect(*renderer, &rect);
+    char line[4096];
+    unsigned int line_number = 0;
+    while (fgets(line, sizeof line, file))
+    {
+        line_number++;
+        if (char *comment = strchr(line, '#'))
+            *comment = '\0';
+
+        char rom[1024];
+        char profile[32];
+        unsigned long long frame = 0;
+        int consumed = 0;
+        if (sscanf(line, " %1023s %n", rom, &consumed) < 1)
+            continue;
 
-            // draw outlines
-            SDL_SetRenderDrawColor(*renderer, 0, 0, 0, 255);
-            SDL_RenderDrawRect(*renderer, &rect);
-        }
-        else
+        Checkpoint checkpoint;
+        checkpoint.rom_file_name = rom;
+
+        const char *rest = line + consumed;
+        if (sscanf(rest, "%31[a-z0-9] %n", profile, &consumed) == 1 && profile_from_name(profile, checkpoint.profile))
+            rest += consumed;
+
+        unsigned long long input_frame;
+        unsigned int mask;
+        while (sscanf(rest, "%llu:%x %n", &input_frame, &mask, &consumed) == 2)
         {
-            // pixel is off, lerp towards black (which should be drawn)
-            uint32_t black = 0x000000FF;
+            checkpoint.inputs.push_back({input_frame, 0, (uint16_t)mask});
+            rest += consumed;
+        }
 
-            if (pixel_color[i] != black)
-                pixel_color[i] = lerp(pixel_color[i], black, lerp_rate);
+        const int fields = 1 + sscanf(rest, "%llu %n", &frame, &consumed);
+        checkpoint.frame = frame;
+        rest += fields == 2 ? consumed : 0;
 
-            uint8_t r = (pixel_color[i] >> 24) & 0xFF;
-            uint8_t g = (pixel_color[i] >> 16) & 0xFF;
-            uint8_t b = (pixel_color[i] >> 8) & 0xFF;
-            uint8_t a = (pixel_color[i] >> 0) & 0xFF;
+        bool ok = fields == 2;
+        if (ok && *rest)
+        {
+            int offset = 0;
+            ok = sscanf(rest, "%x %x %x %n", &checkpoint.display_hash, &checkpoint.cpu_hash, &checkpoint.memory_hash, &offset) == 3;
+            rest += offset;
+            for (uint32_t group = 0; ok && group < 16; ++group)
+            {
+                unsigned long long count;
+                ok = sscanf(rest, group ? ",%llu%n" : "%llu%n", &count, &offset) == 1;
+                checkpoint.executions[group] = count;
+                rest += offset;
+            }
+            checkpoint.measured = ok;
+        }
 
-            SDL_SetRenderDrawColor(*renderer, r, g, b, a);
-            SDL_RenderFillRect(*renderer, &rect);
+        if (!ok)
+        {
+            fprintf(stderr, "%s:%u: expected a rom, optionally a profile and inputs, a frame and optionally its hashes\n",
+                    file_name, line_number);
+            fclose(file);
+            return false;
         }
+
+        checkpoints.push_back(checkpoint);
     }
 
-    SDL_RenderPresent(*renderer);
+    fclose(file);
+    return true;
 }
 
-void Chip8::update_timers(SDL_AudioDeviceID &dev)
+bool write_golden(const char *file_name, const std::vector<Checkpoint> &checkpoints)
 {
-    if (delay_timer)
-        delay_timer--;
+    FILE *file = fopen(file_name, "w");
+    if (!file)
+        return false;
 
-    if (sound_timer)
+    fprintf(file, "# rom  [profile]  [frame:keys ...]  frame  display  cpu  memory  executions of opcode groups 0-F\n");
+    for (const Checkpoint &checkpoint : checkpoints)
     {
-        sound_timer--;
-        SDL_PauseAudioDevice(dev, 0);
+        fprintf(file, "%s ", checkpoint.rom_file_name.c_str());
+        if (checkpoint.profile != PROFILE_COUNT)
+            fprintf(file, "%s ", PROFILE_NAMES[checkpoint.profile]);
+        for (const InputEvent &input : checkpoint.inputs)
+            fprintf(file, "%llu:%04x ", (unsigned long long)input.frame, input.mask);
+        fprintf(file, "%llu %08x %08x %08x ", (unsigned long long)checkpoint.frame, checkpoint.display_hash,
+                checkpoint.cpu_hash, checkpoint.memory_hash);
+        for (uint32_t group = 0; group < 16; ++group)
+            fprintf(file, group ? ",%llu" : "%llu", (unsigned long long)checkpoint.executions[group]);
+        fprintf(file, "\n");
     }
-    else
-        SDL_PauseAudioDevice(dev, 1);
+
+    return fclose(file) == 0;
 }
 
-void Chip8::emulate_instruction()
+// runs a rom from power-on to each of its checkpoints (sorted by frame) at the default clock with seed 0
+// under every core. the interpreter is stepped one instruction at a time to count executions per opcode
+// group; the hashes are taken from it, and every other core must reach exactly the same state
+bool measure_golden(const Options &options, std::vector<Checkpoint> &checkpoints, std::string &error)
 {
-    opcode = ((memory)[pc] << 8) | ((memory)[pc + 1]);
-    pc += 2;
+    const char *rom_file_name = checkpoints.front().rom_file_name.c_str();
+    std::vector<std::unique_ptr<Chip8>> machines;
+    for (uint32_t core = 0; core < CORE_COUNT; ++core)
+        machines.emplace_back(new Chip8(rom_file_name, 0));
 
-    uint16_t NNN = opcode & 0x0FFF;
-    uint8_t NN = opcode & 0x0FF;
-    uint8_t N = opcode & 0x0F;
-    uint8_t X = (opcode >> 8) & 0x0F;
-    uint8_t Y = (opcode >> 4) & 0x0F;
+    Chip8 &reference = *machines[CORE_INTERPRETER];
+    if (reference.state != RUNNING)
+    {
+        error = "could not load rom";
+        return false;
+    }
 
-    switch ((opcode >> 12) & 0x0F)
+    const Profile profile = checkpoints.front().profile != PROFILE_COUNT ? checkpoints.front().profile
+                                                                         : choose_profile(options, reference.rom_identity());
+    for (uint32_t core = 0; core < CORE_COUNT; ++core)
     {
-    case 0x00:
-        if (NN == 0xE0)
-        {
-            // 0x00E0 clear screen
-            printf("0x00E0: Clear screen");
-            memset(&display[0], false, sizeof display);
-        }
-        else if (NN == 0xEE)
+        machines[core]->set_profile(profile);
+        machines[core]->set_core((Core)core);
+    }
+
+    const InputLog &inputs = checkpoints.front().inputs;
+    FrameClock clock(CLOCK_RATE);
+    uint64_t executions[16]{};
+    Snapshot expected, actual;
+    size_t next = 0;
+    size_t next_input = 0;
+
+    for (uint64_t frame = 0;; ++frame)
+    {
+        for (; next < checkpoints.size() && checkpoints[next].frame == frame; ++next)
         {
-            // 0x00EE: return from subroutine
-            printf("0X00EE: Return from subroutine\n");
-            pc = *--stack_ptr;
+            Checkpoint &checkpoint = checkpoints[next];
+            reference.save_state(expected);
+
+            checkpoint.display_hash = reference.display_hash();
+            checkpoint.cpu_hash = fnv1a(expected.registers, sizeof expected.registers);
+            checkpoint.cpu_hash = fnv1a(&expected.index, sizeof expected.index, checkpoint.cpu_hash);
+            checkpoint.cpu_hash = fnv1a(&expected.pc, sizeof expected.pc, checkpoint.cpu_hash);
+            checkpoint.cpu_hash = fnv1a(expected.stack, sizeof expected.stack, checkpoint.cpu_hash);
+            checkpoint.cpu_hash = fnv1a(&expected.stack_depth, sizeof expected.stack_depth, checkpoint.cpu_hash);
+            checkpoint.cpu_hash = fnv1a(&expected.delay_timer, sizeof expected.delay_timer, checkpoint.cpu_hash);
+            checkpoint.cpu_hash = fnv1a(&expected.sound_timer, sizeof expected.sound_timer, checkpoint.cpu_hash);
+            checkpoint.memory_hash = fnv1a(expected.memory, expected.memory_size);
+            memcpy(checkpoint.executions, executions, sizeof executions);
+            checkpoint.measured = true;
+
+            for (uint32_t core = 0; core < CORE_COUNT; ++core)
+            {
+                if (core == CORE_INTERPRETER)
+                    continue;
+                machines[core]->save_state(actual);
+                if (memcmp(&expected, &actual, snapshot_size(expected)) != 0)
+                {
+                    error = std::string(CORE_NAMES[core]) + " core differs from the interpreter at frame " + std::to_string(frame);
+                    return false;
+                }
+            }
         }
-        break;
-
-    case 0x01:
-        // 1NNN jump to NNN
-        printf("1NNN: jump to NNN\n");
-        pc = NNN;
-        break;
 
-    case 0x02:
-        // 0x02NNN: call subroutine at NNN
-        printf("0x02NNN: call subroutine at NNN\n");
-        *stack_ptr++ = pc;
-        pc = NNN;
-        break;
+        if (next == checkpoints.size())
+            return true;
 
-    case 0x03:
-        // 0x3XNN: if VX == NN, skip next instruction;
-        printf("0x3XNN: if VX == NN, skip next instruction");
-        if (registers[X] == NN)
+        for (; next_input < inputs.size() && inputs[next_input].frame <= frame; ++next_input)
         {
-            pc += 2;
+            for (std::unique_ptr<Chip8> &machine : machines)
+                machine->set_keypad(inputs[next_input].mask);
         }
-        break;
 
-    case 0x04:
-        // 0x4XNN: if VX != NN, skip next instruction
-        printf("0x4XNN: if VX != NN, skip next instruction");
-        if (registers[X] != NN)
+        const uint32_t batch = clock.next_frame();
+        for (uint32_t i = 0; i < batch && reference.state == RUNNING; ++i)
         {
-            pc += 2;
+            executions[reference.next_opcode() >> 12]++;
+            reference.emulate_instruction();
         }
-        break;
-
-    case 0x05:
-        // 0x5XY0: if VX == VY, skip next instruction
-        if (N != 0)
-            break;
-        printf("0x5XY0: if VX == VY, skip next instruction");
-        if (registers[X] == registers[Y])
+        for (uint32_t core = 0; core < CORE_COUNT; ++core)
         {
-            pc += 2;
+            if (core != CORE_INTERPRETER && machines[core]->state == RUNNING)
+                machines[core]->run(batch);
         }
-        break;
 
-    case 0x06:
-        // 0x6XNN: set register vx to NN
-        printf("0x06 //set register vx to NN\n");
-        registers[X] = NN;
-        break;
+        for (std::unique_ptr<Chip8> &machine : machines)
+            machine->tick_timers();
+    }
+}
 
-    case 0x07:
-        // 0x07XNN:  set register vx += NN
-        printf("0x07XNN:  set register vx += NN\n");
-        registers[X] += NN;
-        break;
+// describes how a measured checkpoint differs from its golden values
+std::string golden_difference(const Checkpoint &golden, const Checkpoint &measured)
+{
+    std::string parts;
+    if (golden.display_hash != measured.display_hash)
+        parts += " display";
+    if (golden.cpu_hash != measured.cpu_hash)
+        parts += " cpu";
+    if (golden.memory_hash != measured.memory_hash)
+        parts += " memory";
+
+    std::string groups;
+    for (uint32_t group = 0; group < 16; ++group)
+    {
+        if (golden.executions[group] != measured.executions[group])
+            groups += std::string(" ") + OPCODE_GROUPS[group];
+    }
 
-    case 0x08:
-        switch (N)
-        {
-        case 0:
-            // 0x8XY0: set VX = VY
-            printf("0x8XY0: set VX = VY");
-            registers[X] = registers[Y];
-            break;
+    if (parts.empty() && groups.empty())
+        return "";
 
-        case 1:
-            // 0x0XY1: set register VX |= VY
-            printf("0x0XY1: set register VX |= VY");
-            registers[X] |= registers[Y];
-            break;
+    std::string difference = parts.empty() ? " state matches" : parts + " differ";
+    if (!groups.empty())
+        difference += ";" + groups + " ran a different number of times";
+    return difference;
+}
 
-        case 2:
-            // 0x8XY2: set register VX &= VY
-            printf("0x8XY2: set register VX &= VY");
-            registers[X] &= registers[Y];
-            break;
+bool same_inputs(const InputLog &a, const InputLog &b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const InputEvent &x, const InputEvent &y)
+    {
+        return x.frame == y.frame && x.offset == y.offset && x.mask == y.mask;
+    });
+}
 
-        case 3:
-            // 0x8XY3: set register VX ^= VY
-            printf("0x8XY3: set register VX ^= VY");
-            registers[X] ^= registers[Y];
-            break;
+// runs every rom of a golden file in parallel and reports the first checkpoint of each that no longer
+// matches, or with --bless records the current results as the new golden values
+int run_golden_file(const Options &options)
+{
+    std::vector<Checkpoint> golden;
+    if (!load_golden(options.golden_file_name, golden))
+        return EXIT_FAILURE;
 
-        case 4:
-            // 0x8XY4: set register VX += VY and set VF to 1 if overflow, else 0
-            printf("0x8XY4: set register VX += VY and set VF to 1 if overflow, else 0");
-            {
-                bool carry = ((uint16_t)(registers[X] + registers[Y]) > 255);
-                registers[X] += registers[Y];
-                registers[0xF] = carry;
-                break;
-            }
+    // one task per rom, profile and keypad history, checkpoints in frame order
+    std::vector<std::vector<size_t>> roms;
+    for (size_t i = 0; i < golden.size(); ++i)
+    {
+        size_t rom = 0;
+        while (rom < roms.size() && (golden[roms[rom].front()].rom_file_name != golden[i].rom_file_name ||
+                                     golden[roms[rom].front()].profile != golden[i].profile ||
+                                     !same_inputs(golden[roms[rom].front()].inputs, golden[i].inputs)))
+            rom++;
+        if (rom == roms.size())
+            roms.emplace_back();
+        roms[rom].push_back(i);
+    }
 
-        case 5:
-            // 0x8XY5: set register VX-=VY, set VF to 0 when there's underflow, else 1
-            printf("0x8XY5: set register VX-=VY, set VF to 0 when there's underflow, else 1");
-            {
-                bool carry = (registers[X] <= registers[Y]);
-                registers[X] -= registers[Y];
-                registers[0xF] = carry;
-                break;
-            }
+    for (std::vector<size_t> &rom : roms)
+        std::stable_sort(rom.begin(), rom.end(), [&](size_t a, size_t b) { return golden[a].frame < golden[b].frame; });
 
-        case 6:
-            // 0x8XY6: set VX >>= 1, store LSB of VX prior to shift in VF;
-            printf("0x8XY6: set VX >>= 1, store LSB of VX prior to shift in VF");
-            {
-                bool carry = registers[Y] & 1;
-                registers[X] = registers[Y] >> 1;
-                registers[0xF] = carry;
-                break;
-            }
+    std::vector<Checkpoint> measured = golden;
+    std::vector<std::string> errors(roms.size());
 
-        case 7:
-            // 0x8XY7: set VX = VY - VX, set VF to 0 if underflow, else 1
-            printf("0x8XY7: set VX = VY - VX, set VF to 0 if underflow, else 1");
-            {
-                bool carry = registers[X] <= registers[Y];
-                registers[X] = registers[Y] - registers[X];
-                registers[0xF] = carry;
-                break;
-            }
+    const double frequency = (double)SDL_GetPerformanceFrequency();
+    const uint64_t start_time = SDL_GetPerformanceCounter();
 
-        case 0xE:
-            // 0x8XYE set register VX <<= 1, set VF to 1 if MSB of VX prior to shift was set, else 0
-            printf("0x8XYE set register VX <<= 1, set VF to 1 if MSB of VX prior to shift was set, else 0");
+    run_parallel(roms.size(), worker_threads(options), [&](size_t rom)
+    {
+        std::vector<Checkpoint> checkpoints;
+        for (size_t i : roms[rom])
+            checkpoints.push_back(golden[i]);
+
+        measure_golden(options, checkpoints, errors[rom]);
+
+        for (size_t i = 0; i < roms[rom].size(); ++i)
+            measured[roms[rom][i]] = checkpoints[i];
+    });
+
+    const double elapsed = (SDL_GetPerformanceCounter() - start_time) / frequency;
+
+    int status = 0;
+    uint32_t failed = 0;
+    for (size_t rom = 0; rom < roms.size(); ++rom)
+    {
+        const Checkpoint &first = golden[roms[rom].front()];
+        const std::string name = first.profile == PROFILE_COUNT ? first.rom_file_name
+                                                                : first.rom_file_name + " " + PROFILE_NAMES[first.profile];
+        const char *rom_file_name = name.c_str();
+        if (!errors[rom].empty())
+        {
+            printf("%s: %s\n", rom_file_name, errors[rom].c_str());
+            status = EXIT_FAILURE;
+            failed++;
+            continue;
+        }
+
+        if (options.bless)
+            continue;
+
+        for (size_t i : roms[rom])
+        {
+            const std::string difference = golden[i].measured ? golden_difference(golden[i], measured[i]) : " not blessed yet";
+            if (!difference.empty())
             {
-                bool carry = (registers[Y] & 0x80) >> 7;
-                registers[X] = registers[Y] << 1;
-                registers[0xF] = carry;
+                printf("%s: frame %llu:%s\n", rom_file_name, (unsigned long long)golden[i].frame, difference.c_str());
+                status = EXIT_FAILURE;
+                failed++;
                 break;
             }
+        }
+    }
 
-        default:
-            printf("UNIMPLEMENTED INSTRUCTION FOR 0x08\n");
-            break;
+    fprintf(stderr, "%zu roms, %zu checkpoints, %u failed in %.3f s\n", roms.size(), golden.size(), failed, elapsed);
+
+    if (options.bless && status == 0 && !write_golden(options.golden_file_name, measured))
+    {
+        fprintf(stderr, "Could not write golden file %s\n", options.golden_file_name);
+        return EXIT_FAILURE;
+    }
+
+    return status;
+}
+
+// the per-pixel lerp() fade the kernels replace, kept as the reference for --bench-fade
+void fade_lerp(uint32_t *colors, const Bitplane *planes, float lerp_rate)
+{
+    for (uint32_t i = 0; i < HIRES_WIDTH * HIRES_HEIGHT; ++i)
+    {
+        const uint32_t x = i % HIRES_WIDTH, y = i / HIRES_WIDTH, shift = 63 - x % 64;
+        const uint32_t target = PALETTE[((planes[0][y][x / 64] >> shift) & 1) | ((planes[1][y][x / 64] >> shift) & 1) << 1];
+
+        if (colors[i] != target)
+            colors[i] = lerp(colors[i], target, lerp_rate);
+    }
+}
+
+// largest per-channel difference between two pixel buffers
+uint32_t max_channel_error(const uint32_t *a, const uint32_t *b)
+{
+    uint32_t error = 0;
+    for (uint32_t i = 0; i < HIRES_WIDTH * HIRES_HEIGHT; ++i)
+    {
+        for (uint32_t shift = 0; shift < 32; shift += 8)
+        {
+            const int32_t difference = (int32_t)((a[i] >> shift) & 0xFF) - (int32_t)((b[i] >> shift) & 0xFF);
+            const uint32_t magnitude = difference < 0 ? -difference : difference;
+            if (magnitude > error)
+                error = magnitude;
         }
-        break;
+    }
+    return error;
+}
 
-    case 0x09:
-        // 0x9XY0: if VX != VY skip next instruction
-        printf("0x9XY0: if VX != VY, skip next instruction \n");
-        if (registers[X] != registers[Y])
+// times one fade step over the whole screen for lerp() and every kernel this cpu runs, and checks
+// each kernel against lerp() from the same random colors at every lerp_rate the n/m keys can reach
+int run_fade_benchmark()
+{
+    const uint32_t FRAMES = 20000;
+    const double frequency = (double)SDL_GetPerformanceFrequency();
+
+    Bitplane planes[PLANE_COUNT];
+    uint32_t start[HIRES_WIDTH * HIRES_HEIGHT];
+
+    srand(1);
+    for (uint32_t plane = 0; plane < PLANE_COUNT; ++plane)
+        for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+            for (uint32_t half = 0; half < 2; ++half)
+                planes[plane][y][half] = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+    for (uint32_t i = 0; i < HIRES_WIDTH * HIRES_HEIGHT; ++i)
+        start[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+
+    struct
+    {
+        const char *name;
+        FadeKernel kernel;
+        bool supported;
+    } kernels[] = {
+        {"scalar", fade_scalar, true},
+#ifdef CHIP8_X86
+        {"sse2", fade_sse2, (bool)__builtin_cpu_supports("sse2")},
+        {"avx2", fade_avx2, (bool)__builtin_cpu_supports("avx2")},
+#endif
+    };
+
+    uint32_t colors[HIRES_WIDTH * HIRES_HEIGHT];
+    uint32_t reference[HIRES_WIDTH * HIRES_HEIGHT];
+
+    memcpy(colors, start, sizeof colors);
+    uint64_t begin = SDL_GetPerformanceCounter();
+    for (uint32_t frame = 0; frame < FRAMES; ++frame)
+    {
+        // flip a row so the fade never settles
+        uint64_t &row = planes[0][frame % HIRES_HEIGHT][frame / HIRES_HEIGHT % 2];
+        row = ~row;
+        fade_lerp(colors, planes, 0.5);
+    }
+    const double lerp_time = (SDL_GetPerformanceCounter() - begin) / frequency * 1e9 / FRAMES;
+    fprintf(stderr, "%-8s %10.1f ns/frame\n", "lerp", lerp_time);
+
+    for (const auto &entry : kernels)
+    {
+        if (!entry.supported)
+            continue;
+
+        memcpy(colors, start, sizeof colors);
+        begin = SDL_GetPerformanceCounter();
+        for (uint32_t frame = 0; frame < FRAMES; ++frame)
         {
-            pc += 2;
+            uint64_t &row = planes[0][frame % HIRES_HEIGHT][frame / HIRES_HEIGHT % 2];
+            row = ~row;
+            entry.kernel(colors, planes, fade_weight(0.5), ALL_ROWS);
         }
-        break;
+        const double time = (SDL_GetPerformanceCounter() - begin) / frequency * 1e9 / FRAMES;
 
-    case 0x0A:
-        // 0xANNN: set index register I to NNN
-        printf("0xANNN: set index register I to NNN;\n");
-        index = NNN;
-        break;
+        uint32_t error = 0;
+        for (float lerp_rate = 0.1; lerp_rate < 1.05; lerp_rate += 0.1)
+        {
+            memcpy(colors, start, sizeof colors);
+            memcpy(reference, start, sizeof reference);
+            entry.kernel(colors, planes, fade_weight(lerp_rate), ALL_ROWS);
+            fade_lerp(reference, planes, lerp_rate);
+
+            const uint32_t step_error = max_channel_error(colors, reference);
+            if (step_error > error)
+                error = step_error;
+        }
+
+        fprintf(stderr, "%-8s %10.1f ns/frame  %5.1fx  max channel error %u\n", entry.name, time, lerp_time / time, error);
+    }
+
+    return 0;
+}
+
+bool read_snapshot(const char *file_name, Snapshot &snapshot)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file)
+        return false;
+
+    // the header says how much memory follows
+    bool ok = fread(&snapshot, offsetof(Snapshot, memory), 1, file) == 1 && snapshot.memory_size <= MEMORY_SIZE;
+    ok = ok && fread(snapshot.memory, snapshot.memory_size, 1, file) == 1;
+    fclose(file);
+    return ok;
+}
+
+bool write_snapshot(const char *file_name, const Snapshot &snapshot)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file)
+        return false;
 
-    case 0x0B:
-        // 0xBNNN: jump to V0 + NNN
-        printf("0xBNNN: jump to address NNN + V0\n");
-        pc = registers[0] + NNN;
-        break;
+    const bool ok = fwrite(&snapshot, snapshot_size(snapshot), 1, file) == 1;
+    return fclose(file) == 0 && ok;
+}
 
-    case 0x0C:
-        // 0xCXNN: set VX = random%(256) & NN
-        printf("0xCXNN: set VX = NN & (random in [0,255])\n");
-        registers[X] = (rand() % 256) & NN;
-        break;
+// runs the rom for a second, then times save_state() and load_state() alternating between two snapshots
+// a frame apart, the way a rewind or a fork from a shared snapshot would use them
+int run_snapshot_benchmark(Chip8 &chip8, const Options &options)
+{
+    const uint32_t ROUNDS = 100000;
+    const double frequency = (double)SDL_GetPerformanceFrequency();
 
-    case 0x0D:
+    FrameClock clock(options.clock_rate);
+    for (uint32_t frame = 0; frame < FPS; ++frame)
     {
-        // 0xDXYN: draw N height sprite at (X,Y); Read from I;
-        printf("0xDXYN: draw N height sprite at (X,Y); Read from I;\n");
-        uint8_t posX = registers[X] % (WINDOW_WIDTH);
-        uint8_t posY = registers[Y] % (WINDOW_HEIGHT);
-
-        registers[0xF] = 0;
+        chip8.run(clock.next_frame());
+        chip8.tick_timers();
+    }
 
-        for (uint8_t i = 0; i < N; ++i)
-        {
-            uint8_t sprite = memory[index + i];
-            posX = registers[X] % (WINDOW_WIDTH);
+    Snapshot snapshots[2];
+    chip8.save_state(snapshots[0]);
+    chip8.run(clock.next_frame());
+    chip8.tick_timers();
+    chip8.save_state(snapshots[1]);
+
+    uint64_t begin = SDL_GetPerformanceCounter();
+    for (uint32_t round = 0; round < ROUNDS; ++round)
+        chip8.save_state(snapshots[round & 1]);
+    const double save_time = (SDL_GetPerformanceCounter() - begin) / frequency * 1e9 / ROUNDS;
+
+    begin = SDL_GetPerformanceCounter();
+    for (uint32_t round = 0; round < ROUNDS; ++round)
+        chip8.load_state(snapshots[round & 1]);
+    const double load_time = (SDL_GetPerformanceCounter() - begin) / frequency * 1e9 / ROUNDS;
+
+    // per-frame rewind capture over a real second of play
+    RewindBuffer rewind(options.rewind_budget ? options.rewind_budget : 16 << 20);
+    Snapshot snapshot;
+    double push_time = 0;
+    for (uint32_t frame = 0; frame < FPS; ++frame)
+    {
+        chip8.run(clock.next_frame());
+        chip8.tick_timers();
 
-            for (int8_t j = 7; j >= 0; --j)
-            {
-                if ((sprite & (1 << j)) && (display[posY * WINDOW_WIDTH + posX]))
-                {
-                    registers[0xF] = 1;
-                }
+        begin = SDL_GetPerformanceCounter();
+        chip8.save_state(snapshot);
+        rewind.push(snapshot);
+        push_time += SDL_GetPerformanceCounter() - begin;
+    }
 
-                display[posY * WINDOW_WIDTH + posX] ^= (bool)(sprite & (1 << j));
-                if (++posX >= WINDOW_WIDTH)
-                    break;
-            }
+    fprintf(stderr, "%s: %zu byte snapshot | save %.1f ns, restore %.1f ns, rewind capture %.1f ns/frame\n",
+            options.rom_file_name, snapshot_size(snapshot), save_time, load_time, push_time / frequency * 1e9 / FPS);
+    return 0;
+}
 
-            if (++posY >= WINDOW_HEIGHT)
-                break;
-        }
-        break;
+// the emulation thread: runs the cpu and the 60 Hz timers on the frame scheduler and hands every frame that
+// changed the display to the render thread, waking it with frame_event. input arrives under the shared lock.
+// while paused it sleeps until woken, so a paused machine costs no cpu at all; a running one that only waits
+// keeps its timer deadlines but its frames are cut short by the idle loop fast-forward.
+// a frame runs in one go, so the keypad changes of the frame period before it are spread over its
+// instructions by their timestamps: a tap shorter than a frame still reaches the rom, and a rom that reads
+// the keys several times a frame sees them change at the right point
+void run_emulation(Chip8 &chip8, EmulationLock &shared, TripleBuffer &frames, AudioRing &audio, const Options &options, uint32_t frame_event,
+                   InputLog &recording, CaptureWriter *capture)
+{
+    // frames emulated so far, the clock input is recorded against
+    uint64_t frame = 0;
+    // the last wake this thread has seen
+    uint64_t wakes = shared.wakes;
+    // the resolution the render thread was last sent
+    bool hires = false;
+
+    FrameClock clock(options.clock_rate);
+    FrameScheduler scheduler;
+    CpuMeter cpu;
+    // the keypad changes of the frame being run
+    InputLog inputs;
+    int16_t samples[SAMPLES_PER_FRAME];
+
+    std::unique_ptr<RewindBuffer> rewind;
+    Snapshot snapshot;
+    if (options.rewind_budget)
+    {
+        rewind.reset(new RewindBuffer(options.rewind_budget));
+        chip8.save_state(snapshot);
+        rewind->push(snapshot);
     }
-    case 0x0E:
-        if (NN == 0x9E)
-        {
-            // 0xEX9E if key in VX is pressed, skip next inst
-            printf("0xEX9E: if key in VX is pressed, skip next instruction\n");
-            if (keypad[registers[X]])
-            {
-                pc += 2;
-            }
-        }
-        else if (NN == 0xA1)
+
+    for (;;)
+    {
+        bool changed;
+        bool emulated = false;
         {
-            // 0xEX9E: if key in VX is not pressed, skip next inst;
-            printf("0xEX9E: if key in VX isn't pressed, skip next instruction\n");
-            if (!keypad[registers[X]])
+            std::unique_lock<std::mutex> lock(shared.mutex);
+
+            if (chip8.state == PAUSED && shared.wakes == wakes)
+                shared.woken.wait(lock, [&] { return shared.wakes != wakes; });
+            wakes = shared.wakes;
+
+            if (chip8.state == QUIT)
             {
-                pc += 2;
+                cpu.report("frames");
+                return;
             }
-        }
-        break;
 
-    case 0x0F:
-        switch (NN)
-        {
-        case 0x0A:
-        {
-            static bool any_key_pressed = false;
-            static uint8_t key = 0xFF;
-            for (uint8_t i = 0; key == 0xFF && i < sizeof keypad; ++i)
+            if (chip8.state == REWINDING)
             {
-                if (keypad[i])
+                // keys held now stay held, whatever they were back then
+                for (const auto &change : shared.keypad)
+                    chip8.set_keypad(change.mask);
+                shared.keypad.clear();
+                const uint16_t keys = chip8.keypad_mask();
+                if (rewind && rewind->step_back(snapshot))
                 {
-                    key == i;
-                    any_key_pressed = true;
-                    break;
+                    chip8.load_state(snapshot);
+                    frame--;
+                    // the recording continues from here, forget what happened after it
+                    while (!recording.empty() && recording.back().frame >= frame)
+                        recording.pop_back();
                 }
+                chip8.set_keypad(keys);
+                // and a replay has to hold them from here on too
+                if (options.record_file_name)
+                    record_input(recording, {frame, 0, keys});
             }
-            if (!any_key_pressed)
-                pc -= 2;
-            else
+            else if (chip8.state != PAUSED)
             {
-                // wait until key is released
-                if (keypad[key])
-                    pc -= 2;
+                const uint32_t instructions = clock.next_frame();
+
+                // an event a whole frame period old or older lands on the first instruction, one from just
+                // now on the last
+                const uint32_t now = SDL_GetTicks();
+                inputs.clear();
+                for (const auto &change : shared.keypad)
+                {
+                    const int32_t age = std::max<int32_t>(now - change.time, 0);
+                    const uint64_t position = 1000 - std::min<uint64_t>((uint64_t)age * FPS, 1000);
+                    const uint32_t offset = instructions * position / 1000;
+                    inputs.push_back({frame, inputs.empty() ? offset : std::max(offset, inputs.back().offset), change.mask});
+                    if (options.record_file_name)
+                        record_input(recording, inputs.back());
+                }
+                shared.keypad.clear();
+
+                size_t next = 0;
+                if (chip8.profiler.enabled)
+                {
+                    const uint64_t start = SDL_GetPerformanceCounter();
+                    run_frame(chip8, instructions, inputs, next, frame);
+                    const uint64_t ran = SDL_GetPerformanceCounter();
+                    chip8.update_timers(samples);
+                    audio.write(samples, SAMPLES_PER_FRAME);
+                    chip8.profiler.emulation.add(ran - start);
+                    chip8.profiler.timers.add(SDL_GetPerformanceCounter() - ran);
+                }
                 else
                 {
-                    // it has been released
-                    registers[X] = key;
-                    key = 0xFF; // reset to not found
-                    any_key_pressed = false;
+                    run_frame(chip8, instructions, inputs, next, frame);
+                    chip8.update_timers(samples);
+                    audio.write(samples, SAMPLES_PER_FRAME);
+                }
+                frame++;
+                emulated = true;
+
+                if (rewind)
+                {
+                    chip8.save_state(snapshot);
+                    rewind->push(snapshot);
                 }
             }
-            break;
+
+            Frame &back = frames.back_frame();
+            chip8.publish(back);
+            changed = back.dirty_rows || back.hires != hires;
+            hires = back.hires;
         }
 
-        case 0x1E:
-            // 0xFX1E: set I += VX
-            // Need to handle Commodore Amiga case
-            printf("0xFX1E: set I += VX\n");
-            index += registers[X];
-            break;
+        // outside the lock: the capture only copies the frame into its ring, or drops it
+        if (capture && emulated)
+            capture->push(frames.back_frame(), samples, false);
 
-        case 0x07:
-            // 0xFX07: VX = delay timer
-            // Need to implement delay timer
-            printf("0xFX07: Set VX = delay timer value\n");
-            registers[X] = delay_timer;
-            break;
+        // a frame that drew nothing stays in the back buffer, and its dirty rows go out with the next one
+        if (changed)
+        {
+            frames.publish();
 
-        case 0x15:
-            // 0xFX15: delay timer = VX
-            // Need to implement delay timer
-            printf("0xFX15: Set delay timer to value of VX\n");
-            delay_timer = registers[X];
-            break;
+            SDL_Event e{};
+            e.type = frame_event;
+            SDL_PushEvent(&e);
+        }
 
-        case 0x18:
-            // 0xFX18: sound timer = VX
-            // Need to implement sound timer
-            printf("0xFX18: set sound timer to VX\n");
-            sound_timer = registers[X];
-            break;
+        cpu.sample();
 
-        case 0x29:
-            // 0xFX29: Set I to the location of the sprite for the character in VX
-            printf("0xFX29: Set I to the location of the sprite for the character in VX\n");
-            index = registers[X] * 5;
-            break;
+        if (!options.uncapped)
+            scheduler.wait_for_next_frame();
+    }
+}
 
-        case 0x33:
+// writes what the profiler collected, to the files asked for or, after profiling was only switched on
+// with P, to the default names
+bool write_profile(const Chip8 &chip8, const Options &options)
+{
+    if (!chip8.profiler.used())
+        return true;
+
+    const bool named = options.stats_file_name || options.folded_file_name;
+    const char *stats = named ? options.stats_file_name : DEFAULT_STATS_FILE;
+    const char *folded = named ? options.folded_file_name : DEFAULT_FOLDED_FILE;
+    bool ok = true;
+
+    if (stats && !chip8.profiler.write_report(stats, options.rom_file_name))
+    {
+        fprintf(stderr, "Could not write profile %s\n", stats);
+        ok = false;
+    }
+    if (folded && !chip8.profiler.write_folded(folded))
+    {
+        fprintf(stderr, "Could not write call stacks %s\n", folded);
+        ok = false;
+    }
+    return ok;
+}
+
+static_assert(CHIP8_ENV_WIDTH == HIRES_WIDTH && CHIP8_ENV_HEIGHT == HIRES_HEIGHT && CHIP8_ENV_PLANES == PLANE_COUNT,
+              "chip8_env.h describes the display as it is");
+static_assert(sizeof(Bitplane) == HIRES_HEIGHT * 2 * sizeof(uint64_t), "chip8_env.h promises rows of two words");
+
+// chip8_env.h: a machine plus the settings it is reset with. frames run exactly as a headless run's, on
+// the same cores, with tick_timers instead of update_timers and no renderer. PROFILE_COUNT asks the database
+struct chip8_env
+{
+    uint32_t clock_rate;
+    Core core;
+    Profile profile;
+    FrameClock clock;
+    std::unique_ptr<Chip8> chip8;
+};
+
+struct chip8_env_pool
+{
+    WorkerPool workers;
+};
+
+// environments created without quirks share one profile database, chip8_env_load_profiles' or else the
+// default file, found the way the emulator finds it on the first reset that needs it
+std::mutex env_profiles_mutex;
+ProfileDatabase env_profiles;
+bool env_profiles_loaded = false;
+
+Profile env_profile(const char *rom_file_name, uint32_t rom_hash)
+{
+    std::lock_guard<std::mutex> lock(env_profiles_mutex);
+    if (!env_profiles_loaded)
+    {
+        env_profiles_loaded = true;
+        std::string path;
+        ProfileDatabase database;
+        if (!find_default_file(DEFAULT_PROFILE_DATABASE, rom_file_name, path))
+            fprintf(stderr, "Warning: %s not found in the working directory, next to the executable or beside the rom; "
+                            "environments without quirks run with %s quirks\n",
+                    DEFAULT_PROFILE_DATABASE, PROFILE_NAMES[PROFILE_VIP]);
+        else if (load_profile_database(path.c_str(), database))
+            env_profiles.swap(database);
+    }
+    return database_profile(env_profiles, rom_hash);
+}
+
+int chip8_env_load_profiles(const char *file_name)
+{
+    ProfileDatabase database;
+    if (!load_profile_database(file_name, database))
+        return -1;
+
+    std::lock_guard<std::mutex> lock(env_profiles_mutex);
+    env_profiles.swap(database);
+    env_profiles_loaded = true;
+    return 0;
+}
+
+chip8_env *chip8_env_create(uint32_t clock_rate, const char *core, const char *quirks)
+{
+    Core chosen_core = CORE_INTERPRETER;
+    Profile chosen_profile = PROFILE_COUNT;
+    if ((core && !core_from_name(core, chosen_core)) || (quirks && !profile_from_name(quirks, chosen_profile)))
+        return nullptr;
+
+    if (!clock_rate)
+        clock_rate = CLOCK_RATE;
+    return new chip8_env{clock_rate, chosen_core, chosen_profile, FrameClock(clock_rate), nullptr};
+}
+
+void chip8_env_destroy(chip8_env *env)
+{
+    delete env;
+}
+
+int chip8_env_reset(chip8_env *env, const char *rom_file_name, uint32_t seed)
+{
+    env->chip8.reset(new Chip8(rom_file_name, seed));
+    if (env->chip8->state != RUNNING)
+    {
+        env->chip8.reset();
+        return -1;
+    }
+
+    env->chip8->set_core(env->core);
+    env->chip8->set_profile(env->profile != PROFILE_COUNT ? env->profile
+                                                          : env_profile(rom_file_name, env->chip8->rom_identity()));
+    env->clock = FrameClock(env->clock_rate);
+    return 0;
+}
+
+uint32_t chip8_env_step(chip8_env *env, uint16_t keypad_mask, uint32_t frames)
+{
+    if (!env->chip8)
+        return 0;
+
+    Chip8 &chip8 = *env->chip8;
+    chip8.set_keypad(keypad_mask);
+
+    uint32_t frame = 0;
+    for (; frame < frames && chip8.state == RUNNING; ++frame)
+    {
+        chip8.run(env->clock.next_frame());
+        chip8.tick_timers();
+    }
+    return frame;
+}
+
+int chip8_env_done(const chip8_env *env)
+{
+    return !env->chip8 || env->chip8->state != RUNNING;
+}
+
+const uint64_t *chip8_env_framebuffer(const chip8_env *env)
+{
+    return env->chip8 ? &env->chip8->framebuffer()[0][0][0] : nullptr;
+}
+
+int chip8_env_hires(const chip8_env *env)
+{
+    return env->chip8 && env->chip8->high_resolution();
+}
+
+void chip8_env_pixels(const chip8_env *env, uint8_t *out)
+{
+    if (!env->chip8)
+    {
+        memset(out, 0, HIRES_WIDTH * HIRES_HEIGHT);
+        return;
+    }
+
+    const bool hires = env->chip8->high_resolution();
+    for (uint32_t y = 0; y < HIRES_HEIGHT; ++y)
+    {
+        for (uint32_t x = 0; x < HIRES_WIDTH; ++x)
         {
-            // 0xFX33: store BCD representaiton of VX, unit digit at I+2, tens digit at I+1, hundreds digit at I
-            printf("0xFX33: store BCD representaiton of VX, unit digit at I+2, tens digit at I+1, hundreds digit at I\n");
-            uint8_t bcd = registers[X];
-            memory[index + 2] = bcd % 10;
-            bcd /= 10;
-            memory[index + 1] = bcd % 10;
-            bcd /= 10;
-            memory[index] = bcd;
-            break;
+            const uint32_t column = hires ? x : x / 2;
+            const uint32_t row = hires ? y : y / 2;
+            out[y * HIRES_WIDTH + x] = env->chip8->pixel(column, row, 0) | env->chip8->pixel(column, row, 1) << 1;
         }
+    }
+}
 
-        case 0x55:
-            // 0xFX55: dump V0 to VX inclusive starting from I
-            printf("0xFX55: load V0 to VX into memory starting from I\n");
-            for (uint8_t i = 0; i <= X; ++i)
-            {
-                memory[index++] = registers[i];
-            }
-            break;
+const uint8_t *chip8_env_memory(const chip8_env *env)
+{
+    return env->chip8 ? env->chip8->ram() : nullptr;
+}
 
-        case 0x65:
-            // 0xFX65: load V0 to VX inclusive offset from I
-            printf("0xFX65: write V0 to VX values from memory starting with I and incrementing by 1\n");
-            for (uint8_t i = 0; i <= X; ++i)
-            {
-                registers[i] = memory[index++];
-            }
-            break;
+size_t chip8_env_memory_size(const chip8_env *env)
+{
+    return env->chip8 ? env->chip8->ram_size() : 0;
+}
 
-        default:
-            printf("UNIMPLEMENTED INSTRUCTION FOR 0x0F\n");
-            break;
-        }
-        break;
+const uint8_t *chip8_env_registers(const chip8_env *env)
+{
+    return env->chip8 ? env->chip8->v_registers() : nullptr;
+}
 
-    default:
-        printf("UNIMPLEMENTED INSTRUCTION\n");
-        break;
+chip8_env_pool *chip8_env_pool_create(unsigned int threads)
+{
+    return new chip8_env_pool{WorkerPool(threads ? threads : std::thread::hardware_concurrency())};
+}
+
+void chip8_env_pool_destroy(chip8_env_pool *pool)
+{
+    delete pool;
+}
+
+// batches go through the pool's threads, which stay up between calls; without a pool they run here
+void run_env_batch(chip8_env_pool *pool, size_t count, const std::function<void(size_t)> &work)
+{
+    if (pool)
+    {
+        pool->workers.run(count, work);
+        return;
     }
+
+    for (size_t i = 0; i < count; ++i)
+        work(i);
+}
+
+void chip8_env_step_batch(chip8_env_pool *pool, chip8_env *const *envs, size_t count, const uint16_t *keypad_masks,
+                          uint32_t frames)
+{
+    run_env_batch(pool, count, [&](size_t i) { chip8_env_step(envs[i], keypad_masks[i], frames); });
+}
+
+void chip8_env_pixels_batch(chip8_env_pool *pool, chip8_env *const *envs, size_t count, uint8_t *out)
+{
+    run_env_batch(pool, count, [&](size_t i) { chip8_env_pixels(envs[i], out + i * HIRES_WIDTH * HIRES_HEIGHT); });
 }
 
+#if !CHIP8_LIBRARY
 int main(int argc, char **argv)
 {
+    Options options;
+
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // without the database every rom that has no --quirks runs with vip quirks, so a missing default is
+    // worth a warning rather than silence, unless --quirks makes it moot
+    std::string database = options.profile_database_file_name ? options.profile_database_file_name : "";
+    if (database.empty() && !find_default_file(DEFAULT_PROFILE_DATABASE, options.rom_file_name, database) &&
+        options.profile == PROFILE_COUNT)
+        fprintf(stderr, "Warning: %s not found in the working directory, next to the executable or beside the rom; "
+                        "roms without --quirks run with %s quirks\n",
+                DEFAULT_PROFILE_DATABASE, PROFILE_NAMES[PROFILE_VIP]);
+    if (!database.empty() && !load_profile_database(database.c_str(), options.profile_database))
+        exit(EXIT_FAILURE);
 
-    if (argc < 2)
+    if (options.batch_file_name)
+        return run_batch_file(options);
+
+    if (options.golden_file_name)
+        return run_golden_file(options);
+
+    if (options.fade_benchmark)
+        return run_fade_benchmark();
+
+    Movie movie;
+    if (options.replay_file_name && !read_movie(options.replay_file_name, movie))
+    {
+        fprintf(stderr, "Could not read movie %s\n", options.replay_file_name);
+        exit(EXIT_FAILURE);
+    }
+
+    // a movie only replays exactly at the clock and with the quirks it was recorded with, so it brings
+    // them along like its seed. asking for others would replay something else, and is refused
+    if (options.replay_file_name && movie.clock_rate)
+    {
+        if (options.clock_given && options.clock_rate != movie.clock_rate)
+        {
+            fprintf(stderr, "Movie %s was recorded at --clock %u, not %u\n", options.replay_file_name, movie.clock_rate,
+                    options.clock_rate);
+            exit(EXIT_FAILURE);
+        }
+        if (options.profile != PROFILE_COUNT && options.profile != movie.profile)
+        {
+            fprintf(stderr, "Movie %s was recorded with --quirks %s, not %s\n", options.replay_file_name,
+                    PROFILE_NAMES[movie.profile], PROFILE_NAMES[options.profile]);
+            exit(EXIT_FAILURE);
+        }
+        options.clock_rate = movie.clock_rate;
+        options.profile = movie.profile;
+    }
+
+    // an interactive session gets a fresh seed unless asked otherwise, a movie brings its own
+    if (options.replay_file_name)
+        options.seed = movie.seed;
+    else if (!options.seed_given && !options.headless)
+        options.seed = time(NULL);
+    movie.seed = options.seed;
+
+    Chip8 chip8(options.rom_file_name, options.seed);
+
+    if (chip8.state != 'R')
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    chip8.set_core(options.core);
+    chip8.set_profile(choose_profile(options, chip8.rom_identity()));
+    movie.clock_rate = options.clock_rate;
+    movie.profile = chip8.quirk_profile();
+
+    if (options.stats_file_name || options.folded_file_name)
+        chip8.profiler.start();
+
+    if (options.debug)
+    {
+        chip8.state = PAUSED;
+        chip8.debug_command("l");
+    }
+
+    if (options.trace_file_name && !chip8.trace_to(options.trace_file_name))
     {
-        fprintf(stderr, "Usage: %s <rom_file_name>\n", argv[0]);
+        fprintf(stderr, "Could not open trace file %s (tracing needs make TRACE=1)\n", options.trace_file_name);
         exit(EXIT_FAILURE);
     }
 
-    srand(time(NULL));
+    if (options.load_state_file_name)
+    {
+        Snapshot snapshot;
+        if (!read_snapshot(options.load_state_file_name, snapshot) || !chip8.load_state(snapshot))
+        {
+            fprintf(stderr, "Could not load snapshot %s\n", options.load_state_file_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options.snapshot_benchmark)
+        return run_snapshot_benchmark(chip8, options);
+
+    std::unique_ptr<CaptureWriter> capture;
+    if (options.capture_name)
+    {
+        capture.reset(new CaptureWriter());
+        if (!capture->open(options.capture_name))
+            exit(EXIT_FAILURE);
+    }
+
+    if (options.headless)
+    {
+        run_headless(chip8, options, movie.inputs, capture.get());
+        if (!write_profile(chip8, options) || (capture && !capture->close()))
+            exit(EXIT_FAILURE);
+
+        Snapshot snapshot;
+        chip8.save_state(snapshot);
+        if (options.save_state_file_name && !write_snapshot(options.save_state_file_name, snapshot))
+        {
+            fprintf(stderr, "Could not write snapshot %s\n", options.save_state_file_name);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
 
     SDL_Window *window = nullptr;
     SDL_Renderer *renderer = nullptr;
+    SDL_Texture *texture = nullptr;
 
     SDL_AudioDeviceID dev = 0;
     SDL_AudioSpec want, have;
+    AudioRing audio;
 
-    if (initialize_SDL(&window, &renderer, want, have, dev) == false)
+    if (initialize_SDL(&window, &renderer, &texture, want, have, dev, audio, options.audio_buffer_samples) == false)
     {
         exit(EXIT_FAILURE);
     }
 
     set_screen(&renderer);
 
-    char *rom_file_name = argv[1];
-
-    Chip8 chip8(rom_file_name);
-
-    if (chip8.state != 'R')
+    Keymap keymap;
+    // without a keymap file the default bindings apply, so a missing default needs no warning
+    std::string keymap_file = options.keymap_file_name ? options.keymap_file_name : "";
+    if ((!keymap_file.empty() || find_default_file(DEFAULT_KEYMAP_FILE, options.rom_file_name, keymap_file)) &&
+        !load_keymap(keymap_file.c_str(), chip8.rom_identity(), keymap))
     {
+        cleanup(&window, &renderer, &texture, dev);
         exit(EXIT_FAILURE);
     }
+    Controls controls(keymap);
 
-    while (chip8.state != 'Q')
-    {
-        chip8.handle_input();
+    // rendering and input stay on this thread, which SDL requires, the core runs on its own
+    EmulationLock shared;
+    TripleBuffer frames;
+    Screen screen;
+    const uint32_t frame_event = SDL_RegisterEvents(1);
 
-        if (chip8.state == PAUSED)
-            continue;
+    std::thread emulation(run_emulation, std::ref(chip8), std::ref(shared), std::ref(frames), std::ref(audio), std::cref(options), frame_event,
+                          std::ref(movie.inputs), capture.get());
 
-        uint64_t intial_time = SDL_GetPerformanceCounter();
+    // the prompt may be blocked reading stdin when the window closes, so it isn't joined
+    if (options.debug)
+        std::thread(run_debug_console, std::ref(chip8), &shared).detach();
+
+    // this thread's copy of profiler.enabled, taken under the lock whenever input may have changed it.
+    // the render times are only ever touched from here
+    bool profiling = chip8.profiler.enabled;
+    const auto render = [&]()
+    {
+        const uint64_t start = profiling ? SDL_GetPerformanceCounter() : 0;
+        screen.update_screen(&renderer, texture, frames.front_frame());
+        if (profiling)
+            chip8.profiler.render.add(SDL_GetPerformanceCounter() - start);
+    };
+
+    // this thread only wakes for events and new frames, and at FPS while the phosphor is still fading or
+    // the window needs a repaint. the title shows the process cpu usage, refreshed once a second
+    const uint32_t frame_ms = 1000 / FPS;
+    const uint32_t title_ms = 1000;
+    CpuMeter cpu;
+    uint32_t last_render = SDL_GetTicks();
+    uint32_t last_title = last_render;
+    bool running = true;
+    while (running)
+    {
+        const uint32_t now = SDL_GetTicks();
+        if (now - last_title >= title_ms)
+        {
+            char title[64];
+            snprintf(title, sizeof title, "%s | cpu %.1f%%", WINDOW_TITLE, 100 * cpu.sample());
+            SDL_SetWindowTitle(window, title);
+            last_title = now;
+        }
 
-        for (uint32_t i = 0; i < CLOCK_RATE / FPS; ++i)
-            chip8.emulate_instruction();
+        uint32_t timeout = title_ms - (now - last_title);
+        if (screen.busy())
+            timeout = std::min(timeout, now - last_render >= frame_ms ? 0 : frame_ms - (now - last_render));
 
-        uint64_t final_time = SDL_GetPerformanceCounter();
+        SDL_Event e;
+        if (!SDL_WaitEventTimeout(&e, timeout))
+        {
+            if (screen.busy() && SDL_GetTicks() - last_render >= frame_ms)
+            {
+                render();
+                last_render = SDL_GetTicks();
+            }
+            continue;
+        }
 
-        const double delta_time = (double)((1000 * (final_time - intial_time)) / SDL_GetPerformanceFrequency());
+        do
+        {
+            if (e.type == frame_event)
+            {
+                if (frames.consume())
+                {
+                    render();
+                    last_render = SDL_GetTicks();
+                }
+                continue;
+            }
 
-        SDL_Delay(1000 / FPS > delta_time ? 1000 / FPS - delta_time : 0);
+            screen.handle_input(e);
 
-        chip8.update_screen(&renderer);
-        chip8.update_timers(dev);
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            chip8.handle_input(e);
+            if (controls.handle_input(e))
+                shared.keypad.push_back({e.common.timestamp, controls.keys()});
+            shared.wake();
+            running = chip8.state != QUIT;
+            profiling = chip8.profiler.enabled;
+        } while (SDL_PollEvent(&e));
     }
 
-    cleanup(&window, &renderer, dev);
+    emulation.join();
+    write_profile(chip8, options);
+    if (capture)
+        capture->close();
+
+    if (options.record_file_name && !write_movie(options.record_file_name, movie))
+        fprintf(stderr, "Could not write movie %s\n", options.record_file_name);
+
+    screen.release();
+    cleanup(&window, &renderer, &texture, dev);
+    audio.report(have.samples);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,72 @@
+// the emulator core as a library, for stepping many machines from training code at emulation speed.
+// nothing here draws, fades or synthesizes audio. build libchip8.so with make lib
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIP8_ENV_WIDTH 128
+#define CHIP8_ENV_HEIGHT 64
+#define CHIP8_ENV_PLANES 2
+
+typedef struct chip8_env chip8_env;
+typedef struct chip8_env_pool chip8_env_pool;
+
+// clock_rate in instructions per second, 0 for 700. core is "interpreter", "cached" or "block", quirks one of
+// "vip", "chip48", "schip", "modern" or "amiga". a NULL core picks the interpreter, NULL quirks the profile
+// database's entry for each rom reset into it, as the emulator does. NULL for an unknown name
+chip8_env *chip8_env_create(uint32_t clock_rate, const char *core, const char *quirks);
+void chip8_env_destroy(chip8_env *env);
+
+// replaces the profile database of environments without quirks, which is otherwise roms/profiles.txt looked
+// for in the working directory, next to the executable, then beside the first rom. 0 on success, -1 if the
+// file can't be read; takes effect at the next reset
+int chip8_env_load_profiles(const char *file_name);
+
+// powers on with the rom and seed, as if freshly created. roms are read once per process and shared
+// between environments. 0 on success, -1 if the rom can't be loaded
+int chip8_env_reset(chip8_env *env, const char *rom_file_name, uint32_t seed);
+
+// holds keypad_mask (bit k is key k) and runs frames frames of instructions and 60 Hz timer ticks.
+// returns the frames run, fewer once the rom has stopped itself with 00FD or failed to load
+uint32_t chip8_env_step(chip8_env *env, uint16_t keypad_mask, uint32_t frames);
+// nonzero once the machine has stopped
+int chip8_env_done(const chip8_env *env);
+
+// the live display, not a copy, valid until the next reset: CHIP8_ENV_PLANES planes of CHIP8_ENV_HEIGHT rows,
+// each row two words, the first holding pixels 0-63 with pixel x in bit 63 - x and the second pixels 64-127.
+// read it as words, not bytes, and the layout is the same on every host. in lores only the top 32 rows and
+// the first word of each are used
+const uint64_t *chip8_env_framebuffer(const chip8_env *env);
+// nonzero while the rom runs at 128x64
+int chip8_env_hires(const chip8_env *env);
+// CHIP8_ENV_WIDTH * CHIP8_ENV_HEIGHT bytes into out, row-major, plane 1 in bit 0 and plane 2 in bit 1.
+// lores frames are doubled up, so the shape never changes
+void chip8_env_pixels(const chip8_env *env, uint8_t *out);
+// the address space and V0-VF, not copies. memory is 4 KB, or 64 KB under the modern (XO-CHIP) quirks
+const uint8_t *chip8_env_memory(const chip8_env *env);
+size_t chip8_env_memory_size(const chip8_env *env);
+const uint8_t *chip8_env_registers(const chip8_env *env);
+
+// worker threads for the batch calls, started once and kept until destroyed. threads counts the calling
+// thread, which works too (0 for one per core). a pool runs one batch at a time
+chip8_env_pool *chip8_env_pool_create(unsigned int threads);
+void chip8_env_pool_destroy(chip8_env_pool *pool);
+
+// chip8_env_step on count environments, envs[i] holding keypad_masks[i], spread over the pool's threads
+// (NULL to stay on the calling thread)
+void chip8_env_step_batch(chip8_env_pool *pool, chip8_env *const *envs, size_t count, const uint16_t *keypad_masks,
+                          uint32_t frames);
+// chip8_env_pixels of every environment into count consecutive blocks of out
+void chip8_env_pixels_batch(chip8_env_pool *pool, chip8_env *const *envs, size_t count, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif